@@ -9,11 +9,22 @@
 */
 
 
+#include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include <time.h>
+#include <unistd.h>
 
 /**
  * Set the name of the file to be used to train the MarkovModel. The file must
@@ -33,12 +44,244 @@
 */
 #define MAX_QUOTE_LENGTH 50
 
+/**
+ * Set the number of quotes printed by the program.
+*/
+#define QUOTE_COUNT 1
+
+/**
+ * Set the number of iovec entries buffered before generated quotes are written
+ * to stdout with a single writev() call. Must not exceed IOV_MAX.
+*/
+#define QUOTE_IOV_COUNT 1024
+
+/**
+ * Set to 1 to write each word of a quote as soon as it is sampled rather than
+ * buffering whole quotes, trading throughput for time to first word.
+*/
+#define STREAM_QUOTES 0
+
+/**
+ * Set a space separated list of words that generated quotes must not contain.
+ * Banned words are excluded while sampling instead of rejecting whole quotes,
+ * and also match with trailing punctuation. A quote whose context only leads
+ * to banned words ends early.
+*/
+#define BANNED_WORDS ""
+
 /**
  * Sets the number of buckets to be used in hashmaps. This constant is used in
  * the hashmap implemented within the MarkovModel data structure.
 */
 #define HASH_MAP_SIZE 420
 
+/**
+ * Sets the maximum length of a line read from FILE_NAME, and therefore of a
+ * single word.
+*/
+#define MARKOV_LINE_SIZE 1024
+
+/**
+ * Set the number of words buffered before they are inserted into the
+ * MarkovModel during training. The contexts of a batch are hashed and their
+ * buckets prefetched before any insertion, hiding memory latency. Set to 1 to
+ * insert each word as soon as it is read.
+*/
+#define INSERT_BATCH_SIZE 16
+
+/**
+ * Set the number of quotes generated during the profiling run that records
+ * how often each context of the MarkovFrozen model is visited. The recorded
+ * frequencies are used to move hot contexts to the front of the frozen layout.
+ * Set to 0 to fall back to ordering contexts by their total successor count.
+*/
+#define PROFILE_QUOTE_COUNT 2000
+
+/**
+ * Set to 1 to mlock() the pages holding the hot contexts of the MarkovFrozen
+ * model after the layout has been optimized. The pages are always prefaulted;
+ * locking them additionally keeps them from being swapped out.
+*/
+#define FROZEN_LOCK_HOT_PAGES 0
+
+/**
+ * Set the number of quotes used to measure generation latency. When non-zero,
+ * the first-quote and steady-state latencies of the MarkovFrozen model are
+ * printed to stderr before and after the layout is optimized.
+*/
+#define BENCHMARK_QUOTE_COUNT 0
+
+/**
+ * Set the number of word classes used to train the MarkovModel. When non-zero,
+ * words are clustered into classes by frequency, contexts are built over class
+ * labels, and generation emits real words from per-class emission tables. Set
+ * to 0 to train over words.
+*/
+#define WORD_CLASS_COUNT 0
+
+/**
+ * Cap the vocabulary used to train the MarkovModel. Only the VOCAB_MAX_WORDS
+ * most frequent words that occur at least VOCAB_MIN_COUNT times are kept; all
+ * other words are replaced by OOV_WORD. Set VOCAB_MAX_WORDS to 0 and
+ * VOCAB_MIN_COUNT to 1 to keep every word.
+*/
+#define VOCAB_MAX_WORDS 0
+#define VOCAB_MIN_COUNT 1
+
+/**
+ * The token that stands in for every word removed by the vocabulary cap.
+ * Corpus words that equal OOV_WORD are escaped with a leading backslash, so
+ * they stay distinct from the removed words.
+*/
+#define OOV_WORD "<unk>"
+
+/**
+ * Set the number of removed words kept in the side table that generation
+ * samples from when it emits OOV_WORD.
+*/
+#define OOV_SIDE_TABLE_SIZE 256
+
+/**
+ * Set the number of threads that tokenize FILE_NAME in parallel when counting
+ * the vocabulary for word classes or a vocabulary cap. Each thread keeps a
+ * cache of INTERN_CACHE_SIZE (a power of two) recently seen words in front of
+ * the shared vocabulary table.
+*/
+#define TOKENIZER_THREAD_COUNT 4
+#define INTERN_CACHE_SIZE 256
+
+/**
+ * Set the number of threads that train the model from FILE_NAME. Tokenizer
+ * threads split ranges of the file and route each context to the training
+ * thread owning its bucket through queues of TRAIN_QUEUE_SIZE (a power of two)
+ * entries, so buckets are never shared. Set to 0 or 1 to train on a single
+ * thread.
+*/
+#define TRAIN_THREAD_COUNT 0
+#define TRAIN_QUEUE_SIZE 1024
+
+/**
+ * Set the number of threads that compile the trained model into its frozen
+ * form. Each thread counts and then compiles a contiguous range of buckets.
+ * Set to 0 or 1 to freeze on a single thread.
+*/
+#define FREEZE_THREAD_COUNT 4
+
+/**
+ * Set the fraction of the successor array that blocks replaced by incremental
+ * updates may take before the frozen model is compacted.
+*/
+#define REFREEZE_COMPACT_RATIO 0.5
+
+/**
+ * Set the number of quotes reservoir sampled from FILE_NAME to train a small
+ * preview model that serves quotes while the full model trains in the
+ * background. The full model is swapped in once it is ready. Set to 0 to
+ * train the full model before serving.
+*/
+#define PREVIEW_QUOTE_COUNT 0
+
+/**
+ * Set to 1 to generate quotes with a suffix array over the whole training file
+ * instead of the fixed MARKOV_CONTEXT_SIZE model. Each word then follows the
+ * longest context, back to the start of the quote, seen at least
+ * SUFFIX_MIN_COUNT times; a minimum of 1 mostly copies training quotes. The
+ * suffix array is sorted on SUFFIX_THREAD_COUNT threads.
+*/
+#define SUFFIX_ENGINE 0
+#define SUFFIX_MIN_COUNT 2
+#define SUFFIX_THREAD_COUNT 4
+
+/**
+ * Set the number of decompressed pages cached when the successors of the
+ * frozen model are stored compressed. Pages hold about PAGE_TARGET_SUCCESSORS
+ * successors each and the cache is split into PAGE_CACHE_SHARDS independently
+ * locked LRU lists. Set to 0 to keep the successors uncompressed.
+*/
+#define PAGE_CACHE_PAGES 0
+#define PAGE_TARGET_SUCCESSORS 512
+#define PAGE_CACHE_SHARDS 8
+
+/**
+ * Configure the analyze command. The stationary distribution is computed by
+ * power iteration on ANALYSIS_THREAD_COUNT threads until the L1 change of an
+ * iteration drops below ANALYSIS_TOLERANCE, for at most
+ * ANALYSIS_MAX_ITERATIONS iterations. ANALYSIS_TOP_STATES sets the number of
+ * most probable contexts printed.
+*/
+#define ANALYSIS_THREAD_COUNT 4
+#define ANALYSIS_TOLERANCE 1e-9
+#define ANALYSIS_MAX_ITERATIONS 2000
+#define ANALYSIS_TOP_STATES 10
+
+/**
+ * Configure the drift command. DRIFT_TOP_CONTEXTS sets the number of most
+ * drifting contexts printed and DRIFT_SMOOTHING the count added to every
+ * successor so the KL divergence stays finite when a successor disappears.
+ * The comparison runs on ANALYSIS_THREAD_COUNT threads.
+*/
+#define DRIFT_TOP_CONTEXTS 10
+#define DRIFT_SMOOTHING 0.5
+
+/**
+ * Set the number of most frequent contexts and context and successor pairs
+ * printed by the top command.
+*/
+#define TOP_NGRAM_COUNT 20
+
+/**
+ * Configure the metrics command. METRICS_QUOTE_COUNT sets the number of quotes
+ * generated when no file of quotes is given, and METRICS_MAX_N the longest
+ * n-grams measured.
+*/
+#define METRICS_QUOTE_COUNT 100000
+#define METRICS_MAX_N 4
+
+/**
+ * Set the requests sent by the load command, as space separated
+ * <quotes>:<max words> entries used in turn; request i is seeded with
+ * LOAD_SEED + i so runs are reproducible. A test lasts LOAD_SECONDS, and open
+ * loop tests are served by LOAD_THREAD_COUNT threads.
+*/
+#define LOAD_REQUEST_MIX "1:50 4:20 1:10"
+#define LOAD_SEED 1
+#define LOAD_SECONDS 5
+#define LOAD_THREAD_COUNT 4
+
+/**
+ * Set the overload control of open loop serving. Once the queue delay of
+ * requests stays above OVERLOAD_TARGET_MS for OVERLOAD_INTERVAL_MS, requests
+ * are shortened to OVERLOAD_SHORT_LENGTH words per quote and, at the rate of
+ * the CoDel control law, answered from a pool of OVERLOAD_POOL_SIZE
+ * pre-generated quotes. Requests that cannot finish within
+ * OVERLOAD_DEADLINE_MS of their arrival are rejected. Set OVERLOAD_TARGET_MS
+ * to 0 to serve every request in full.
+*/
+#define OVERLOAD_TARGET_MS 5
+#define OVERLOAD_INTERVAL_MS 100
+#define OVERLOAD_DEADLINE_MS 50
+#define OVERLOAD_SHORT_LENGTH 10
+#define OVERLOAD_POOL_SIZE 1024
+
+/**
+ * Set how the sessions command streams quotes: each session sends
+ * SESSION_QUOTE_COUNT quotes through a buffer of SESSION_BUFFER_SIZE bytes
+ * that the simulated clients drain every SESSION_DRAIN_MICROSECONDS. Sessions
+ * run on SESSION_THREAD_COUNT workers for at most SESSION_STEP_BUDGET words
+ * before yielding to other sessions.
+*/
+#define SESSION_QUOTE_COUNT 20
+#define SESSION_BUFFER_SIZE 256
+#define SESSION_DRAIN_MICROSECONDS 1000
+#define SESSION_THREAD_COUNT 4
+#define SESSION_STEP_BUDGET 64
+
+/**
+ * Set the number of bytes the models mapped by the registry command may take
+ * before the least recently used ones are unmapped.
+*/
+#define REGISTRY_MEMORY_BUDGET (64 << 20)
+
 /**
  * MarkovContext stores an array of char pointers that represent the last X 
  * number of words.
@@ -196,6 +439,81 @@ MarkovContext *markov_context_copy(MarkovContext *original_context) {
   return new_context;
 }
 
+/**
+ * The state of the xorshift64* generator of the calling thread, 0 until it is
+ * seeded.
+*/
+_Thread_local uint64_t markov_random_state;
+
+/**
+ * Seeds the generator of the calling thread from the splitmix64 output of
+ * seed, so that equal seeds give equal sequences on any thread.
+*/
+void markov_random_seed(uint64_t seed) {
+  uint64_t z = seed + 0x9e3779b97f4a7c15ULL;
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  markov_random_state = (z ^ (z >> 31)) | 1;
+}
+
+/**
+ * Returns the next number from a xorshift64* generator with one state per
+ * thread, seeded on first use from the clock and the address of the state.
+*/
+uint64_t markov_random_next(void) {
+  uint64_t state = markov_random_state;
+  if (state == 0) {
+    state = ((uint64_t)time(NULL) << 32) ^ (uint64_t)(uintptr_t)&markov_random_state;
+    state |= 1;
+  }
+  state ^= state >> 12;
+  state ^= state << 25;
+  state ^= state >> 27;
+  markov_random_state = state;
+  return state * 2685821657736338717ULL;
+}
+
+/**
+ * The number of independent generators in a MarkovRandomStreams. Lanes are
+ * advanced together in plain loops the compiler can vectorize.
+*/
+#define MARKOV_RANDOM_LANES 8
+
+/**
+ * A set of MARKOV_RANDOM_LANES xorshift64* generators, each seeded from its
+ * own splitmix64 output so their sequences do not overlap in practice.
+*/
+typedef struct MarkovRandomStreams {
+  uint64_t state[MARKOV_RANDOM_LANES];
+} MarkovRandomStreams;
+
+/**
+ * Seeds every lane of a MarkovRandomStreams from one seed.
+*/
+void markov_random_streams_seed(MarkovRandomStreams *streams, uint64_t seed) {
+  for (size_t lane = 0; lane < MARKOV_RANDOM_LANES; ++lane) {
+    seed += 0x9e3779b97f4a7c15ULL;
+    uint64_t z = seed;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    streams->state[lane] = (z ^ (z >> 31)) | 1;
+  }
+}
+
+/**
+ * Advances every lane of a MarkovRandomStreams and writes one number per lane.
+*/
+void markov_random_streams_next(MarkovRandomStreams *streams, uint64_t *out) {
+  for (size_t lane = 0; lane < MARKOV_RANDOM_LANES; ++lane) {
+    uint64_t state = streams->state[lane];
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    streams->state[lane] = state;
+    out[lane] = state * 2685821657736338717ULL;
+  }
+}
+
 /**
  * A linked list data structure that contains key/value mappings of words and
  * their respective counts.
@@ -279,7 +597,7 @@ char *markov_value_get_random(MarkovValue *value) {
     value_ptr = value_ptr->next;
   }
   value_ptr = value;
-  size_t r = rand() % total_count;
+  size_t r = markov_random_next() % total_count;
   while (value_ptr) {
     if (r < value_ptr->count) {
       return value_ptr->word;
@@ -292,12 +610,14 @@ char *markov_value_get_random(MarkovValue *value) {
 
 /**
  * A linked list data structure that contains MarkovContexts and a MarkovValue
- * linked list representing all the values associated with that context.
+ * linked list representing all the values associated with that context. Dirty
+ * is set while the node is in the dirty list of its MarkovModel.
 */
 typedef struct MarkovNode {
   MarkovContext *context;
   MarkovValue *value;
   struct MarkovNode *next;
+  bool dirty;
 } MarkovNode;
 
 /**
@@ -319,6 +639,7 @@ MarkovNode *markov_node_add_node(MarkovNode *node, MarkovContext *context, char
   new_node->context = markov_context_copy(context);
   new_node->value = markov_value_add_word(NULL, word);
   new_node->next = node;
+  new_node->dirty = false;
   return new_node;
 }
 
@@ -358,11 +679,17 @@ void markov_node_free(MarkovNode *node) {
 /**
  * A data structure representing a Markov chain. It implements a hash map so 
  * that data can be accessed in O(1) time instead of the O(n) time associated
- * with a linked list.
+ * with a linked list. When track_dirty is set, every node changed since the
+ * last markov_model_clear_dirty() is listed once in dirty, so a frozen copy of
+ * the model can be patched with only those contexts.
 */
 typedef struct MarkovModel {
   size_t size;
   MarkovNode **nodes;
+  bool track_dirty;
+  size_t dirty_count;
+  size_t dirty_capacity;
+  MarkovNode **dirty;
 } MarkovModel;
 
 /**
@@ -370,12 +697,47 @@ typedef struct MarkovModel {
  * number of buckets in the hashmap.
 */
 MarkovModel *markov_model_new(size_t size) {
-  MarkovModel *model = malloc(sizeof(MarkovModel));
+  MarkovModel *model = calloc(1, sizeof(MarkovModel));
   model->size = size;
   model->nodes = calloc(size, sizeof(MarkovNode*));
   return model;
 }
 
+/**
+ * Adds a word and its context to a bucket of the model. If the model tracks
+ * dirty nodes, the node of the context is added to the dirty list unless it is
+ * already there. Tracking is not thread safe.
+*/
+void markov_model_insert(MarkovModel *model, size_t index, MarkovContext *context,
+                         char *word) {
+  model->nodes[index] = markov_node_add_node(model->nodes[index], context, word);
+  if (!model->track_dirty) { return; }
+  MarkovNode *node = model->nodes[index];
+  while (!markov_context_check_match(node->context, context)) {
+    node = node->next;
+  }
+  if (!node->dirty) {
+    if (model->dirty_count == model->dirty_capacity) {
+      model->dirty_capacity = model->dirty_capacity ? model->dirty_capacity * 2 : 64;
+      model->dirty = realloc(model->dirty,
+                             model->dirty_capacity * sizeof(MarkovNode *));
+    }
+    model->dirty[model->dirty_count++] = node;
+    node->dirty = true;
+  }
+}
+
+/**
+ * Empties the dirty list of a MarkovModel, typically once a frozen copy has
+ * been patched with its nodes.
+*/
+void markov_model_clear_dirty(MarkovModel *model) {
+  for (size_t i = 0; i < model->dirty_count; ++i) {
+    model->dirty[i]->dirty = false;
+  }
+  model->dirty_count = 0;
+}
+
 /**
  * Adds a word and its context to the model. It finds the proper bucket and 
  * calls markov_node_add_node() with that data.
@@ -385,7 +747,7 @@ void markov_model_add_data(MarkovModel *model, MarkovContext *context, char *wor
     return;
   }
   size_t index = markov_context_get_hash(context) % model->size;
-  model->nodes[index] = markov_node_add_node(model->nodes[index], context, word);
+  markov_model_insert(model, index, context, word);
 }
 
 /**
@@ -412,121 +774,6736 @@ void markov_model_free(MarkovModel *model) {
     }
   }
   free(model->nodes);
+  free(model->dirty);
   free(model);
 }
 
 /**
- * Loads the data from a provided file into a MarkovModel object and returns a
- * pointer to this object. The caller is responsible for freeing the 
- * MarkovModel.
+ * A buffer of (context, word) pairs waiting to be added to a MarkovModel.
+ * Instead of hashing, loading a bucket and walking its chain for one word at
+ * a time, markov_insert_batch_flush() hashes every buffered context first,
+ * prefetches the buckets and the nodes they point to, and only then performs
+ * the insertions, so the memory accesses of the batch overlap. Words are
+ * copied into an arena and the buffered contexts borrow pointers into it;
+ * markov_node_add_node() makes its own copies when it creates a node. Window
+ * is the running context of the quote being loaded.
 */
-MarkovModel *markov_model_load_file(const char *file_name) {
-  FILE *file = fopen(file_name, "r");
-  if (!file) {
-    perror("Unable to open file.");
-    return NULL;
-  }
+typedef struct MarkovInsertBatch {
+  MarkovModel *model;
+  size_t count;
+  MarkovContext contexts[INSERT_BATCH_SIZE];
+  char *words[INSERT_BATCH_SIZE];
+  size_t indices[INSERT_BATCH_SIZE];
+  MarkovContext window;
+  size_t arena_used;
+  char arena[(INSERT_BATCH_SIZE + MARKOV_CONTEXT_SIZE) * MARKOV_LINE_SIZE];
+} MarkovInsertBatch;
 
-  /** Initializes a new MarkovContext instance. This instance will be the 
-   * running context tracker and will be copied to provide the MarkovContexts
-   * specific to individual words */
-  MarkovContext *context = markov_context_new();
-  MarkovModel *model = markov_model_new(HASH_MAP_SIZE);
+/**
+ * Returns a new, empty MarkovInsertBatch that adds to the given model. The
+ * caller is responsible for freeing it with markov_insert_batch_free().
+*/
+MarkovInsertBatch *markov_insert_batch_new(MarkovModel *model) {
+  MarkovInsertBatch *batch = calloc(1, sizeof(MarkovInsertBatch));
+  batch->model = model;
+  return batch;
+}
 
-  char line[1024];
-  while (fgets(line, sizeof(line), file)) {
-    char *word = strtok(line, " \t\n\r");
-    if (!word) {
-      context = markov_context_reset(context);
-    } else if (word[0] != '-'){
-      while (word != NULL) {
-        markov_model_add_data(model, context, word);
-        markov_context_push_word(context, word);
-        word = strtok(NULL, " \t\n\r");
-      }
+/**
+ * Adds every buffered pair to the model of a MarkovInsertBatch and empties the
+ * buffer. The words of the running context are moved to the front of the
+ * arena so the arena can be reused.
+*/
+void markov_insert_batch_flush(MarkovInsertBatch *batch) {
+  MarkovModel *model = batch->model;
+  for (size_t i = 0; i < batch->count; ++i) {
+    batch->indices[i] = markov_context_get_hash(&batch->contexts[i]) % model->size;
+    __builtin_prefetch(&model->nodes[batch->indices[i]]);
+  }
+  for (size_t i = 0; i < batch->count; ++i) {
+    __builtin_prefetch(model->nodes[batch->indices[i]]);
+  }
+  for (size_t i = 0; i < batch->count; ++i) {
+    markov_model_insert(model, batch->indices[i], &batch->contexts[i], batch->words[i]);
+  }
+  batch->count = 0;
+
+  batch->arena_used = 0;
+  for (size_t i = 0; i < MARKOV_CONTEXT_SIZE; ++i) {
+    char *word = batch->window.previous_words[i];
+    if (word) {
+      size_t length = strlen(word) + 1;
+      memmove(batch->arena + batch->arena_used, word, length);
+      batch->window.previous_words[i] = batch->arena + batch->arena_used;
+      batch->arena_used += length;
     }
   }
+}
 
-  markov_context_free(context);
-  fclose(file);
+/**
+ * Buffers a word together with the running context of a MarkovInsertBatch,
+ * then pushes the word onto the running context. Flushes the batch when it is
+ * full.
+*/
+void markov_insert_batch_add(MarkovInsertBatch *batch, const char *word) {
+  size_t length = strlen(word) + 1;
+  char *copy = batch->arena + batch->arena_used;
+  memcpy(copy, word, length);
+  batch->arena_used += length;
 
-  return model;
+  batch->contexts[batch->count] = batch->window;
+  batch->words[batch->count] = copy;
+  batch->count++;
+
+  memmove(batch->window.previous_words, batch->window.previous_words + 1,
+          (MARKOV_CONTEXT_SIZE - 1) * sizeof(char *));
+  batch->window.previous_words[MARKOV_CONTEXT_SIZE - 1] = copy;
+  if (batch->count == INSERT_BATCH_SIZE) {
+    markov_insert_batch_flush(batch);
+  }
 }
 
 /**
- * When given a context, returns a possible next word based upon the data in a
- * provided model. The caller is responsible for updating the context.
+ * Resets the running context of a MarkovInsertBatch at the end of a quote.
+ * Buffered pairs keep their own contexts.
 */
-char *markov_model_get_next(MarkovModel *model, MarkovContext *context) {
-  MarkovNode *node = model->nodes[markov_context_get_hash(context) % model->size];
-  char *word = NULL;
-  while (node) {
-    if (markov_context_check_match(node->context, context)) {
-      word = markov_value_get_random(node->value);
-      return word;
-    }
-    node = node->next;
+void markov_insert_batch_end_quote(MarkovInsertBatch *batch) {
+  for (size_t i = 0; i < MARKOV_CONTEXT_SIZE; ++i) {
+    batch->window.previous_words[i] = NULL;
   }
-  return word;
 }
 
 /**
- * Returns true if a word contains specific end conditions (. or ! or ?).
+ * Flushes a MarkovInsertBatch and frees it. The model it adds to is not freed.
 */
-bool check_end_condition(char *word) {
-  if (strchr(word, '.') || strchr(word, '!') || strchr(word, '?')) {
-    return true;
+void markov_insert_batch_free(MarkovInsertBatch *batch) {
+  if (!batch) { return; }
+  markov_insert_batch_flush(batch);
+  free(batch);
+}
+
+/**
+ * Marks the absence of a word in arrays of word ids, such as the leading slots
+ * of a context at the start of a quote.
+*/
+#define MARKOV_NO_WORD UINT32_MAX
+
+/**
+ * Return the hash for a single word. The hash is calculated using the djb2
+ * algorithm, matching markov_context_get_hash().
+*/
+size_t markov_word_get_hash(const char *word) {
+  size_t hash = 5381;
+  int c;
+  while ((c = *word++)) {
+    hash = ((hash << 5) + hash) + c;
   }
-  return false;
+  return hash;
 }
 
 /**
- * Returns a pointer to a given quote with the given word appended. The caller
- * is responsible for freeing the quote.
+ * A vocabulary that maps each distinct word to a dense integer id and keeps a
+ * count of how often each word was added. Ids are assigned in insertion order
+ * and never change. Lookups use an open addressing table of ids.
 */
-char *add_word_to_quote(char *quote, char *word) {
-  if (quote == NULL || word == NULL) {
-    return quote;
+typedef struct MarkovVocab {
+  size_t size;
+  size_t capacity;
+  char **words;
+  size_t *counts;
+  size_t slot_count;
+  uint32_t *slots;
+} MarkovVocab;
+
+/**
+ * Returns a new, empty MarkovVocab instance. The caller is responsible for
+ * freeing it with markov_vocab_free().
+*/
+MarkovVocab *markov_vocab_new(void) {
+  MarkovVocab *vocab = calloc(1, sizeof(MarkovVocab));
+  vocab->capacity = 64;
+  vocab->words = malloc(vocab->capacity * sizeof(char *));
+  vocab->counts = malloc(vocab->capacity * sizeof(size_t));
+  vocab->slot_count = 128;
+  vocab->slots = malloc(vocab->slot_count * sizeof(uint32_t));
+  memset(vocab->slots, 0xff, vocab->slot_count * sizeof(uint32_t));
+  return vocab;
+}
+
+/**
+ * Returns the id of a word, or MARKOV_NO_WORD if the word is not part of the
+ * vocabulary.
+*/
+uint32_t markov_vocab_find(MarkovVocab *vocab, const char *word) {
+  size_t mask = vocab->slot_count - 1;
+  size_t slot = markov_word_get_hash(word) & mask;
+  while (vocab->slots[slot] != MARKOV_NO_WORD) {
+    uint32_t id = vocab->slots[slot];
+    if (strcmp(vocab->words[id], word) == 0) {
+      return id;
+    }
+    slot = (slot + 1) & mask;
   }
-  size_t length = strlen(quote) + strlen(word) + 2;
-  quote = realloc(quote, length);
-  if (quote[0] != '\0') {
-    strcat(quote, " ");
+  return MARKOV_NO_WORD;
+}
+
+/**
+ * Doubles the number of slots in the lookup table of a MarkovVocab and
+ * reinserts every id.
+*/
+void markov_vocab_grow_slots(MarkovVocab *vocab) {
+  free(vocab->slots);
+  vocab->slot_count *= 2;
+  vocab->slots = malloc(vocab->slot_count * sizeof(uint32_t));
+  memset(vocab->slots, 0xff, vocab->slot_count * sizeof(uint32_t));
+  size_t mask = vocab->slot_count - 1;
+  for (uint32_t id = 0; id < vocab->size; ++id) {
+    size_t slot = markov_word_get_hash(vocab->words[id]) & mask;
+    while (vocab->slots[slot] != MARKOV_NO_WORD) {
+      slot = (slot + 1) & mask;
+    }
+    vocab->slots[slot] = id;
   }
-  strcat(quote, word);
-  return quote;
 }
 
 /**
- * Returns a quote based upon the contained in the given MarkovModel.
+ * Returns the id of a word, adding a copy of the word to the vocabulary with a
+ * count of zero if it is not already present.
 */
-char *markov_model_generate_quote(MarkovModel *model) {
-  MarkovContext *context = markov_context_new();
-  size_t counter = 0;
-  char *quote = calloc(1, 1);
-  while (counter <= MAX_QUOTE_LENGTH) {
-    char *word = markov_model_get_next(model, context);
-    context = markov_context_push_word(context, word);
-    if (!word) { break; }
-    quote = add_word_to_quote(quote, word);
-    if (check_end_condition(word)) { break; }
-    counter++;
+uint32_t markov_vocab_intern(MarkovVocab *vocab, const char *word) {
+  uint32_t id = markov_vocab_find(vocab, word);
+  if (id != MARKOV_NO_WORD) { return id; }
+  if (vocab->size == vocab->capacity) {
+    vocab->capacity *= 2;
+    vocab->words = realloc(vocab->words, vocab->capacity * sizeof(char *));
+    vocab->counts = realloc(vocab->counts, vocab->capacity * sizeof(size_t));
   }
-  markov_context_free(context);
-  return quote;
+  if ((vocab->size + 1) * 2 > vocab->slot_count) {
+    markov_vocab_grow_slots(vocab);
+  }
+  id = vocab->size++;
+  vocab->words[id] = strdup(word);
+  vocab->counts[id] = 0;
+  size_t mask = vocab->slot_count - 1;
+  size_t slot = markov_word_get_hash(word) & mask;
+  while (vocab->slots[slot] != MARKOV_NO_WORD) {
+    slot = (slot + 1) & mask;
+  }
+  vocab->slots[slot] = id;
+  return id;
 }
 
-int main(int argc, char **argv) {
-  (void)argc;
-  (void)argv;
-  srand(time(NULL));
+/**
+ * Frees all the data associated with a MarkovVocab.
+*/
+void markov_vocab_free(MarkovVocab *vocab) {
+  if (!vocab) { return; }
+  for (size_t i = 0; i < vocab->size; ++i) {
+    free(vocab->words[i]);
+  }
+  free(vocab->words);
+  free(vocab->counts);
+  free(vocab->slots);
+  free(vocab);
+}
 
-  MarkovModel *model = markov_model_load_file(FILE_NAME);
+/**
+ * Adds a word to a MarkovVocab, interning it if necessary, and increments its
+ * count. Returns the id of the word.
+*/
+uint32_t markov_vocab_add_word(MarkovVocab *vocab, const char *word) {
+  uint32_t id = markov_vocab_intern(vocab, word);
+  vocab->counts[id]++;
+  return id;
+}
 
-  char *quote = markov_model_generate_quote(model);
-  printf("\n%s\n\n", quote);
-  free(quote);
+/**
+ * A function called by markov_file_for_each_word() for each word of a training
+ * file. Word is NULL at the end of each quote.
+*/
+typedef void (*MarkovWordHandler)(void *state, char *word);
 
-  markov_model_free(model);
-  return EXIT_SUCCESS;
+/**
+ * Splits the lines of a training file that start within the byte range
+ * [start, end) into words and calls handler with each of them. Blank lines
+ * end a quote and lines starting with '-' (attributions) are skipped. A line
+ * that starts before the range is left to the range that contains its start.
+ *
+ * @return Returns false if the file could not be opened.
+*/
+bool markov_file_for_each_word_in_range(const char *file_name, long start, long end,
+                                        MarkovWordHandler handler, void *state) {
+  FILE *file = fopen(file_name, "r");
+  if (!file) {
+    perror("Unable to open file.");
+    return false;
+  }
+  char line[MARKOV_LINE_SIZE];
+  char *save;
+  long offset = start;
+  if (start > 0) {
+    fseek(file, start - 1, SEEK_SET);
+    int c = fgetc(file);
+    while (c != '\n' && c != EOF) {
+      c = fgetc(file);
+      offset++;
+    }
+  }
+  while (offset < end && fgets(line, sizeof(line), file)) {
+    offset += strlen(line);
+    char *word = strtok_r(line, " \t\n\r", &save);
+    if (!word) {
+      handler(state, NULL);
+    } else if (word[0] != '-'){
+      while (word != NULL) {
+        handler(state, word);
+        word = strtok_r(NULL, " \t\n\r", &save);
+      }
+    }
+  }
+  handler(state, NULL);
+  fclose(file);
+  return true;
+}
+
+/**
+ * Splits a training file into words and calls handler with each of them. Word
+ * is NULL at the end of each quote.
+ *
+ * @return Returns false if the file could not be opened.
+*/
+bool markov_file_for_each_word(const char *file_name, MarkovWordHandler handler,
+                               void *state) {
+  return markov_file_for_each_word_in_range(file_name, 0, LONG_MAX, handler, state);
+}
+
+/**
+ * Splits the quotes of a training file attributed to an author into words and
+ * calls handler with each of them, like markov_file_for_each_word(). A quote
+ * is kept when its attribution line (starting with '-') contains author.
+ * Quotes without an attribution are skipped.
+ *
+ * @return Returns false if the file could not be opened.
+*/
+bool markov_file_for_each_word_by(const char *file_name, const char *author,
+                                  MarkovWordHandler handler, void *state) {
+  FILE *file = fopen(file_name, "r");
+  if (!file) {
+    perror("Unable to open file.");
+    return false;
+  }
+  char line[MARKOV_LINE_SIZE];
+  size_t capacity = MARKOV_LINE_SIZE;
+  size_t length = 0;
+  char *quote = malloc(capacity);
+  char *save;
+  while (fgets(line, sizeof(line), file)) {
+    char *start = line + strspn(line, " \t");
+    if (start[0] == '-') {
+      if (strstr(start, author)) {
+        quote[length] = '\0';
+        for (char *word = strtok_r(quote, " \t\n\r", &save); word;
+             word = strtok_r(NULL, " \t\n\r", &save)) {
+          handler(state, word);
+        }
+        handler(state, NULL);
+      }
+      length = 0;
+    } else if (start[strspn(start, "\n\r")] == '\0') {
+      length = 0;
+    } else {
+      size_t line_length = strlen(line);
+      if (length + line_length + 1 > capacity) {
+        capacity = 2 * (length + line_length + 1);
+        quote = realloc(quote, capacity);
+      }
+      memcpy(quote + length, line, line_length);
+      length += line_length;
+    }
+  }
+  free(quote);
+  fclose(file);
+  return true;
+}
+
+/**
+ * A MarkovWordHandler that counts each word into a MarkovVocab.
+*/
+void markov_vocab_count_word(void *state, char *word) {
+  if (word) { markov_vocab_add_word(state, word); }
+}
+
+/**
+ * An entry of a MarkovInternTable. Entries are immutable once published except
+ * for their count. Id is MARKOV_NO_WORD until the inserting thread assigns it.
+*/
+typedef struct MarkovInternEntry {
+  size_t hash;
+  _Atomic uint32_t id;
+  atomic_size_t count;
+  char word[];
+} MarkovInternEntry;
+
+/**
+ * A vocabulary that many tokenizer threads can intern words into at once.
+ * Slots form a fixed-size open addressing table of entry pointers: lookups
+ * are plain atomic loads, and an insert claims an empty slot with a single
+ * compare-and-swap, so no thread ever blocks another. Ids are handed out in
+ * the order entries are published and never change. The table does not grow;
+ * markov_intern_table_intern() fails once it is three quarters full.
+*/
+typedef struct MarkovInternTable {
+  size_t slot_count;
+  _Atomic(MarkovInternEntry *) *slots;
+  _Atomic uint32_t size;
+} MarkovInternTable;
+
+/**
+ * Returns a new, empty MarkovInternTable with the given number of slots, which
+ * must be a power of two. The caller is responsible for freeing it with
+ * markov_intern_table_free().
+*/
+MarkovInternTable *markov_intern_table_new(size_t slot_count) {
+  MarkovInternTable *table = calloc(1, sizeof(MarkovInternTable));
+  table->slot_count = slot_count;
+  table->slots = calloc(slot_count, sizeof(*table->slots));
+  atomic_init(&table->size, 0);
+  return table;
+}
+
+/**
+ * Returns the entry of a word, publishing a new entry if the word is not yet
+ * in the table. If another thread publishes the same word first, its entry is
+ * returned instead. Returns NULL if the table is full.
+*/
+MarkovInternEntry *markov_intern_table_intern(MarkovInternTable *table,
+                                              const char *word, size_t hash) {
+  size_t mask = table->slot_count - 1;
+  size_t slot = hash & mask;
+  MarkovInternEntry *created = NULL;
+  for (size_t probes = 0; probes < table->slot_count; ++probes) {
+    MarkovInternEntry *entry = atomic_load_explicit(&table->slots[slot],
+                                                    memory_order_acquire);
+    if (!entry) {
+      size_t size = atomic_load_explicit(&table->size, memory_order_relaxed);
+      if (size >= table->slot_count / 4 * 3) { break; }
+      if (!created) {
+        size_t length = strlen(word) + 1;
+        created = malloc(sizeof(MarkovInternEntry) + length);
+        created->hash = hash;
+        atomic_init(&created->id, MARKOV_NO_WORD);
+        atomic_init(&created->count, 0);
+        memcpy(created->word, word, length);
+      }
+      if (atomic_compare_exchange_strong_explicit(&table->slots[slot], &entry,
+                                                  created, memory_order_release,
+                                                  memory_order_acquire)) {
+        atomic_store_explicit(&created->id, atomic_fetch_add(&table->size, 1),
+                              memory_order_release);
+        return created;
+      }
+    }
+    if (entry->hash == hash && strcmp(entry->word, word) == 0) {
+      free(created);
+      return entry;
+    }
+    slot = (slot + 1) & mask;
+  }
+  free(created);
+  return NULL;
+}
+
+/**
+ * Returns the id of an entry, waiting for the thread that published it to
+ * assign the id if necessary.
+*/
+uint32_t markov_intern_entry_get_id(MarkovInternEntry *entry) {
+  uint32_t id = atomic_load_explicit(&entry->id, memory_order_acquire);
+  while (id == MARKOV_NO_WORD) {
+    id = atomic_load_explicit(&entry->id, memory_order_acquire);
+  }
+  return id;
+}
+
+/**
+ * Returns a MarkovVocab holding the words of a MarkovInternTable with the same
+ * ids and counts. Must not be called while threads are still interning. The
+ * caller is responsible for freeing the vocabulary.
+*/
+MarkovVocab *markov_intern_table_to_vocab(MarkovInternTable *table) {
+  size_t size = atomic_load(&table->size);
+  MarkovInternEntry **entries = malloc(size * sizeof(MarkovInternEntry *));
+  for (size_t i = 0; i < table->slot_count; ++i) {
+    MarkovInternEntry *entry = atomic_load(&table->slots[i]);
+    if (entry) { entries[markov_intern_entry_get_id(entry)] = entry; }
+  }
+  MarkovVocab *vocab = markov_vocab_new();
+  for (size_t id = 0; id < size; ++id) {
+    markov_vocab_intern(vocab, entries[id]->word);
+    vocab->counts[id] = atomic_load(&entries[id]->count);
+  }
+  free(entries);
+  return vocab;
+}
+
+/**
+ * Frees a MarkovInternTable and all of its entries.
+*/
+void markov_intern_table_free(MarkovInternTable *table) {
+  if (!table) { return; }
+  for (size_t i = 0; i < table->slot_count; ++i) {
+    free(atomic_load(&table->slots[i]));
+  }
+  free(table->slots);
+  free(table);
+}
+
+/**
+ * A per-thread, direct-mapped cache of recently interned entries in front of a
+ * shared MarkovInternTable. Hot words are found without touching the shared
+ * table, and their counts are accumulated in pending and only added to the
+ * shared entry when the cache slot is evicted or flushed, so threads do not
+ * contend on the counters of common words.
+*/
+typedef struct MarkovInternCache {
+  MarkovInternTable *table;
+  bool failed;
+  MarkovInternEntry *entries[INTERN_CACHE_SIZE];
+  size_t pending[INTERN_CACHE_SIZE];
+} MarkovInternCache;
+
+/**
+ * Adds the pending count of one slot of a MarkovInternCache to its entry.
+*/
+void markov_intern_cache_flush_slot(MarkovInternCache *cache, size_t slot) {
+  if (cache->entries[slot] && cache->pending[slot]) {
+    atomic_fetch_add_explicit(&cache->entries[slot]->count, cache->pending[slot],
+                              memory_order_relaxed);
+  }
+  cache->pending[slot] = 0;
+}
+
+/**
+ * A MarkovWordHandler that counts a word into the MarkovInternTable behind a
+ * MarkovInternCache. Marks the cache as failed if the table is full.
+*/
+void markov_intern_cache_count_word(void *state, char *word) {
+  MarkovInternCache *cache = state;
+  if (!word || cache->failed) { return; }
+  size_t hash = markov_word_get_hash(word);
+  size_t slot = hash & (INTERN_CACHE_SIZE - 1);
+  MarkovInternEntry *entry = cache->entries[slot];
+  if (!entry || entry->hash != hash || strcmp(entry->word, word) != 0) {
+    markov_intern_cache_flush_slot(cache, slot);
+    entry = markov_intern_table_intern(cache->table, word, hash);
+    if (!entry) {
+      cache->failed = true;
+      return;
+    }
+    cache->entries[slot] = entry;
+  }
+  cache->pending[slot]++;
+}
+
+/**
+ * A thread counting the words of one byte range of a training file.
+*/
+typedef struct MarkovTokenizerTask {
+  const char *file_name;
+  long start;
+  long end;
+  bool loaded;
+  pthread_t thread;
+  MarkovInternCache cache;
+} MarkovTokenizerTask;
+
+/**
+ * The body of a tokenizer thread. Counts the words of its range of the file
+ * and flushes its cache.
+*/
+void *markov_tokenizer_run(void *state) {
+  MarkovTokenizerTask *task = state;
+  task->loaded =
+      markov_file_for_each_word_in_range(task->file_name, task->start, task->end,
+                                         markov_intern_cache_count_word, &task->cache);
+  for (size_t i = 0; i < INTERN_CACHE_SIZE; ++i) {
+    markov_intern_cache_flush_slot(&task->cache, i);
+  }
+  return NULL;
+}
+
+/**
+ * Counts every word of a training file using thread_count tokenizer threads,
+ * each reading its own byte range of the file and interning into one shared
+ * MarkovInternTable. Returns NULL if the file could not be read or has more
+ * distinct words than the table can hold. The caller is responsible for
+ * freeing the returned vocabulary.
+*/
+MarkovVocab *markov_vocab_count_file_parallel(const char *file_name,
+                                              size_t thread_count) {
+  FILE *file = fopen(file_name, "r");
+  if (!file) { return NULL; }
+  fseek(file, 0, SEEK_END);
+  long size = ftell(file);
+  fclose(file);
+
+  /** Distinct words grow much slower than the file, so a quarter of its size
+   * is a generous bound for the table */
+  size_t slot_count = 1024;
+  while (slot_count < (size_t)size / 4 && slot_count < ((size_t)1 << 30)) {
+    slot_count *= 2;
+  }
+  MarkovInternTable *table = markov_intern_table_new(slot_count);
+  MarkovTokenizerTask *tasks = calloc(thread_count, sizeof(MarkovTokenizerTask));
+  for (size_t i = 0; i < thread_count; ++i) {
+    tasks[i].file_name = file_name;
+    tasks[i].start = size * i / thread_count;
+    tasks[i].end = size * (i + 1) / thread_count;
+    tasks[i].cache.table = table;
+    pthread_create(&tasks[i].thread, NULL, markov_tokenizer_run, &tasks[i]);
+  }
+  bool complete = true;
+  for (size_t i = 0; i < thread_count; ++i) {
+    pthread_join(tasks[i].thread, NULL);
+    complete = complete && tasks[i].loaded && !tasks[i].cache.failed;
+  }
+  free(tasks);
+  MarkovVocab *vocab = complete ? markov_intern_table_to_vocab(table) : NULL;
+  markov_intern_table_free(table);
+  return vocab;
+}
+
+/**
+ * Counts every word of a training file in a single pass and returns the
+ * resulting MarkovVocab, or NULL if the file could not be opened. Uses
+ * TOKENIZER_THREAD_COUNT threads when configured, falling back to a single
+ * thread if the shared table overflows. The caller is responsible for freeing
+ * the vocabulary.
+*/
+MarkovVocab *markov_vocab_count_file(const char *file_name) {
+  if (TOKENIZER_THREAD_COUNT > 1) {
+    MarkovVocab *vocab = markov_vocab_count_file_parallel(file_name,
+                                                          TOKENIZER_THREAD_COUNT);
+    if (vocab) { return vocab; }
+  }
+  MarkovVocab *vocab = markov_vocab_new();
+  if (!markov_file_for_each_word(file_name, markov_vocab_count_word, vocab)) {
+    markov_vocab_free(vocab);
+    return NULL;
+  }
+  return vocab;
+}
+
+/**
+ * Word classes used to train a MarkovModel over class labels instead of
+ * words. Each word of the vocabulary belongs to exactly one class, and each
+ * class keeps a MarkovValue list of its words and their counts from which
+ * generation emits real words.
+*/
+typedef struct MarkovClasses {
+  MarkovVocab *vocab;
+  size_t class_count;
+  uint32_t *word_classes;
+  char **labels;
+  size_t *counts;
+  MarkovValue **emissions;
+} MarkovClasses;
+
+/**
+ * The sort key of a word used by markov_classes_new().
+*/
+typedef struct MarkovVocabRank {
+  size_t count;
+  uint32_t id;
+  const char *word;
+} MarkovVocabRank;
+
+/**
+ * Compares two MarkovVocabRank instances so that qsort() orders them from the
+ * most to the least frequent word, breaking ties by the words themselves.
+ * Ids depend on the order in which tokenizer threads interned the words, so
+ * they cannot break ties deterministically.
+*/
+int markov_vocab_rank_compare(const void *a, const void *b) {
+  const MarkovVocabRank *rank_a = a;
+  const MarkovVocabRank *rank_b = b;
+  if (rank_a->count != rank_b->count) { return rank_a->count < rank_b->count ? 1 : -1; }
+  return strcmp(rank_a->word, rank_b->word);
+}
+
+/**
+ * Clusters the words of a counted MarkovVocab into class_count classes by
+ * frequency binning: words are sorted by descending count and split so that
+ * each class covers roughly the same share of all word occurrences. Frequent
+ * words end up in small classes of their own while the long tail shares a few
+ * large ones. Takes ownership of the vocabulary. The caller is responsible for
+ * freeing the returned instance with markov_classes_free().
+*/
+MarkovClasses *markov_classes_new(MarkovVocab *vocab, size_t class_count) {
+  MarkovClasses *classes = calloc(1, sizeof(MarkovClasses));
+  classes->vocab = vocab;
+  classes->class_count = class_count;
+  classes->word_classes = malloc(vocab->size * sizeof(uint32_t));
+  classes->labels = malloc(class_count * sizeof(char *));
+  classes->counts = calloc(class_count, sizeof(size_t));
+  classes->emissions = calloc(class_count, sizeof(MarkovValue *));
+  for (size_t i = 0; i < class_count; ++i) {
+    char label[32];
+    snprintf(label, sizeof(label), "c%zu", i);
+    classes->labels[i] = strdup(label);
+  }
+
+  MarkovVocabRank *ranks = malloc(vocab->size * sizeof(MarkovVocabRank));
+  size_t total = 0;
+  for (uint32_t id = 0; id < vocab->size; ++id) {
+    ranks[id].count = vocab->counts[id];
+    ranks[id].id = id;
+    ranks[id].word = vocab->words[id];
+    total += vocab->counts[id];
+  }
+  qsort(ranks, vocab->size, sizeof(MarkovVocabRank), markov_vocab_rank_compare);
+
+  size_t covered = 0;
+  for (size_t i = 0; i < vocab->size; ++i) {
+    uint32_t id = ranks[i].id;
+    size_t class = covered * class_count / total;
+    covered += vocab->counts[id];
+    classes->word_classes[id] = class;
+    classes->counts[class] += vocab->counts[id];
+    MarkovValue *emission = markov_value_new(vocab->words[id]);
+    emission->count = vocab->counts[id];
+    emission->next = classes->emissions[class];
+    classes->emissions[class] = emission;
+  }
+  free(ranks);
+  return classes;
+}
+
+/**
+ * Returns the class label of a word. Words missing from the vocabulary are
+ * placed in the last (rarest) class.
+*/
+char *markov_classes_get_label(MarkovClasses *classes, const char *word) {
+  uint32_t id = markov_vocab_find(classes->vocab, word);
+  if (id == MARKOV_NO_WORD) { return classes->labels[classes->class_count - 1]; }
+  return classes->labels[classes->word_classes[id]];
+}
+
+/**
+ * Returns the index of the class with the given label.
+*/
+size_t markov_classes_parse_label(const char *label) {
+  return strtoul(label + 1, NULL, 10);
+}
+
+/**
+ * Frees all the data associated with a MarkovClasses instance, including its
+ * vocabulary.
+*/
+void markov_classes_free(MarkovClasses *classes) {
+  if (!classes) { return; }
+  for (size_t i = 0; i < classes->class_count; ++i) {
+    free(classes->labels[i]);
+    markov_value_free(classes->emissions[i]);
+  }
+  markov_vocab_free(classes->vocab);
+  free(classes->word_classes);
+  free(classes->labels);
+  free(classes->counts);
+  free(classes->emissions);
+  free(classes);
+}
+
+/**
+ * Makes a copy of a MarkovVocab with the same words, ids and counts. The caller
+ * is responsible for freeing the copy.
+*/
+MarkovVocab *markov_vocab_copy(MarkovVocab *vocab) {
+  MarkovVocab *copy = markov_vocab_new();
+  for (uint32_t id = 0; id < vocab->size; ++id) {
+    markov_vocab_intern(copy, vocab->words[id]);
+    copy->counts[id] = vocab->counts[id];
+  }
+  return copy;
+}
+
+/**
+ * A capped vocabulary. Vocab holds the kept words and OOV_WORD, with the
+ * combined count of all removed words. Rare_words is a bounded side table of
+ * removed words, sampled in proportion to their counts, that replaces
+ * OOV_WORD in generated quotes.
+*/
+typedef struct MarkovOov {
+  MarkovVocab *vocab;
+  size_t rare_count;
+  char *rare_words[OOV_SIDE_TABLE_SIZE];
+} MarkovOov;
+
+/**
+ * Returns true if a word is OOV_WORD preceded by any number of backslashes.
+ * Such corpus words get one more backslash when trained, so that OOV_WORD
+ * itself only ever stands for the removed words.
+*/
+bool markov_oov_is_escapable(const char *word) {
+  return strcmp(word + strspn(word, "\\"), OOV_WORD) == 0;
+}
+
+/**
+ * Returns the word to output for a trained word, which is the word without its
+ * escape if it is an escaped corpus word.
+*/
+char *markov_oov_unescape(char *word) {
+  if (word[0] == '\\' && markov_oov_is_escapable(word)) { return word + 1; }
+  return word;
+}
+
+/**
+ * Writes the trained form of a corpus word to escaped, which holds size bytes,
+ * and returns it: the word with a leading backslash if it is escapable, or the
+ * word itself otherwise.
+*/
+const char *markov_oov_escape(const char *word, char *escaped, size_t size) {
+  if (!markov_oov_is_escapable(word)) { return word; }
+  snprintf(escaped, size, "\\%s", word);
+  return escaped;
+}
+
+/**
+ * Caps a counted MarkovVocab to its max_words most frequent words with a count
+ * of at least min_count (a max_words of 0 means no limit). Removed words are
+ * reservoir sampled, one draw per occurrence, into the side table. Frees the
+ * provided vocabulary. The caller is responsible for freeing the returned
+ * instance with markov_oov_free().
+*/
+MarkovOov *markov_oov_new(MarkovVocab *counts, size_t max_words, size_t min_count) {
+  MarkovOov *oov = calloc(1, sizeof(MarkovOov));
+  oov->vocab = markov_vocab_new();
+  uint32_t oov_id = markov_vocab_intern(oov->vocab, OOV_WORD);
+
+  MarkovVocabRank *ranks = malloc(counts->size * sizeof(MarkovVocabRank));
+  for (uint32_t id = 0; id < counts->size; ++id) {
+    ranks[id].count = counts->counts[id];
+    ranks[id].id = id;
+    ranks[id].word = counts->words[id];
+  }
+  qsort(ranks, counts->size, sizeof(MarkovVocabRank), markov_vocab_rank_compare);
+
+  size_t seen = 0;
+  for (size_t i = 0; i < counts->size; ++i) {
+    char *word = counts->words[ranks[i].id];
+    size_t count = ranks[i].count;
+    if ((max_words == 0 || i < max_words) && count >= min_count) {
+      char escaped[MARKOV_LINE_SIZE + 1];
+      const char *kept = markov_oov_escape(word, escaped, sizeof(escaped));
+      uint32_t id = markov_vocab_intern(oov->vocab, kept);
+      oov->vocab->counts[id] = count;
+      continue;
+    }
+    oov->vocab->counts[oov_id] += count;
+    for (size_t j = 0; j < count; ++j) {
+      size_t slot = seen++;
+      if (slot >= OOV_SIDE_TABLE_SIZE) {
+        slot = markov_random_next() % seen;
+        if (slot >= OOV_SIDE_TABLE_SIZE) { continue; }
+        free(oov->rare_words[slot]);
+      } else {
+        oov->rare_count++;
+      }
+      oov->rare_words[slot] = strdup(word);
+    }
+  }
+  free(ranks);
+  markov_vocab_free(counts);
+  return oov;
+}
+
+/**
+ * Returns the trained form of a word if it was kept by the vocabulary cap, or
+ * OOV_WORD if it was removed. The returned word is owned by the vocabulary.
+*/
+char *markov_oov_map_word(MarkovOov *oov, char *word) {
+  char escaped[MARKOV_LINE_SIZE + 1];
+  const char *kept = markov_oov_escape(word, escaped, sizeof(escaped));
+  uint32_t id = markov_vocab_find(oov->vocab, kept);
+  if (id == MARKOV_NO_WORD) { return OOV_WORD; }
+  return oov->vocab->words[id];
+}
+
+/**
+ * Returns a random removed word from the side table to stand in for OOV_WORD,
+ * or OOV_WORD itself if no words were removed.
+*/
+char *markov_oov_sample(MarkovOov *oov) {
+  if (oov->rare_count == 0) { return OOV_WORD; }
+  return oov->rare_words[markov_random_next() % oov->rare_count];
+}
+
+/**
+ * Frees all the data associated with a MarkovOov instance.
+*/
+void markov_oov_free(MarkovOov *oov) {
+  if (!oov) { return; }
+  for (size_t i = 0; i < oov->rare_count; ++i) {
+    free(oov->rare_words[i]);
+  }
+  markov_vocab_free(oov->vocab);
+  free(oov);
+}
+
+/**
+ * The state threaded through markov_file_for_each_word() while loading a
+ * training file into a MarkovModel.
+*/
+typedef struct MarkovLoadState {
+  MarkovModel *model;
+  MarkovInsertBatch *batch;
+  MarkovClasses *classes;
+  MarkovOov *oov;
+} MarkovLoadState;
+
+/**
+ * A MarkovWordHandler that adds a word and its context to a MarkovModel. Words
+ * removed by the vocabulary cap are replaced by OOV_WORD and, when classes are
+ * provided, the class label of the word is added instead.
+*/
+void markov_model_load_word(void *state, char *word) {
+  MarkovLoadState *load = state;
+  if (!word) {
+    markov_insert_batch_end_quote(load->batch);
+    return;
+  }
+  if (load->oov) {
+    word = markov_oov_map_word(load->oov, word);
+  }
+  if (load->classes) {
+    word = markov_classes_get_label(load->classes, word);
+  }
+  markov_insert_batch_add(load->batch, word);
+}
+
+/**
+ * A context and the word that followed it, routed from a tokenizer thread to
+ * the training thread owning the bucket of the context. The words are copies
+ * owned by the arena of the tokenizer.
+*/
+typedef struct MarkovTrainRecord {
+  size_t bucket;
+  char *previous_words[MARKOV_CONTEXT_SIZE];
+  char *word;
+} MarkovTrainRecord;
+
+/**
+ * A single-producer, single-consumer ring of TRAIN_QUEUE_SIZE (a power of two)
+ * MarkovTrainRecords. Only the producer writes tail and only the consumer
+ * writes head, so each side needs one atomic load of the other's index per
+ * record. Done is set by the producer after its last record.
+*/
+typedef struct MarkovTrainQueue {
+  _Atomic size_t head;
+  char head_padding[64 - sizeof(size_t)];
+  _Atomic size_t tail;
+  char tail_padding[64 - sizeof(size_t)];
+  _Atomic bool done;
+  MarkovTrainRecord records[TRAIN_QUEUE_SIZE];
+} MarkovTrainQueue;
+
+/**
+ * Adds a record to a MarkovTrainQueue, yielding while the queue is full.
+*/
+void markov_train_queue_push(MarkovTrainQueue *queue, const MarkovTrainRecord *record) {
+  size_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+  while (tail - atomic_load_explicit(&queue->head, memory_order_acquire)
+         == TRAIN_QUEUE_SIZE) {
+    sched_yield();
+  }
+  queue->records[tail & (TRAIN_QUEUE_SIZE - 1)] = *record;
+  atomic_store_explicit(&queue->tail, tail + 1, memory_order_release);
+}
+
+/**
+ * Removes the oldest record of a MarkovTrainQueue into record. Returns false
+ * if the queue is empty.
+*/
+bool markov_train_queue_pop(MarkovTrainQueue *queue, MarkovTrainRecord *record) {
+  size_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+  size_t tail = atomic_load_explicit(&queue->tail, memory_order_acquire);
+  if (head == tail) { return false; }
+  *record = queue->records[head & (TRAIN_QUEUE_SIZE - 1)];
+  atomic_store_explicit(&queue->head, head + 1, memory_order_release);
+  return true;
+}
+
+/**
+ * A block of an arena of words, which are copied into blocks back to back and
+ * stay valid until the arena is freed.
+*/
+typedef struct MarkovWordArena {
+  size_t used;
+  struct MarkovWordArena *next;
+  char data[];
+} MarkovWordArena;
+
+/**
+ * The size of the data of each block of a MarkovWordArena. Words are shorter
+ * than MARKOV_LINE_SIZE, so any word fits in an empty block.
+*/
+#define MARKOV_WORD_ARENA_SIZE (64 * MARKOV_LINE_SIZE)
+
+/**
+ * A tokenizer thread of hash-partitioned training. Splits its byte range of
+ * the training file into words, tracks the running context, and routes each
+ * context and word to the owner of its bucket through queues[owner].
+*/
+typedef struct MarkovTrainTokenizer {
+  const char *file_name;
+  long start;
+  long end;
+  size_t size;
+  size_t owner_count;
+  MarkovClasses *classes;
+  MarkovOov *oov;
+  MarkovTrainQueue **queues;
+  MarkovWordArena *arena;
+  MarkovContext window;
+  bool loaded;
+  pthread_t thread;
+} MarkovTrainTokenizer;
+
+/**
+ * A MarkovWordHandler that routes a word and its context to the training
+ * thread owning the bucket of the context.
+*/
+void markov_train_tokenizer_word(void *state, char *word) {
+  MarkovTrainTokenizer *tokenizer = state;
+  if (!word) {
+    memset(&tokenizer->window, 0, sizeof(MarkovContext));
+    return;
+  }
+  if (tokenizer->oov) {
+    word = markov_oov_map_word(tokenizer->oov, word);
+  }
+  if (tokenizer->classes) {
+    word = markov_classes_get_label(tokenizer->classes, word);
+  }
+  size_t length = strlen(word) + 1;
+  if (!tokenizer->arena || tokenizer->arena->used + length > MARKOV_WORD_ARENA_SIZE) {
+    MarkovWordArena *block = malloc(sizeof(MarkovWordArena) + MARKOV_WORD_ARENA_SIZE);
+    block->used = 0;
+    block->next = tokenizer->arena;
+    tokenizer->arena = block;
+  }
+  char *copy = tokenizer->arena->data + tokenizer->arena->used;
+  memcpy(copy, word, length);
+  tokenizer->arena->used += length;
+
+  MarkovTrainRecord record;
+  record.bucket = markov_context_get_hash(&tokenizer->window) % tokenizer->size;
+  memcpy(record.previous_words, tokenizer->window.previous_words,
+         sizeof(record.previous_words));
+  record.word = copy;
+  markov_train_queue_push(tokenizer->queues[record.bucket % tokenizer->owner_count],
+                          &record);
+
+  memmove(tokenizer->window.previous_words, tokenizer->window.previous_words + 1,
+          (MARKOV_CONTEXT_SIZE - 1) * sizeof(char *));
+  tokenizer->window.previous_words[MARKOV_CONTEXT_SIZE - 1] = copy;
+}
+
+/**
+ * The body of a tokenizer thread. Routes every word of its range, then marks
+ * its queues done.
+*/
+void *markov_train_tokenizer_run(void *state) {
+  MarkovTrainTokenizer *tokenizer = state;
+  tokenizer->loaded =
+      markov_file_for_each_word_in_range(tokenizer->file_name, tokenizer->start,
+                                         tokenizer->end, markov_train_tokenizer_word,
+                                         tokenizer);
+  for (size_t i = 0; i < tokenizer->owner_count; ++i) {
+    atomic_store_explicit(&tokenizer->queues[i]->done, true, memory_order_release);
+  }
+  return NULL;
+}
+
+/**
+ * A training thread of hash-partitioned training. Owns the buckets of the
+ * model whose index modulo the number of owners is its index, and is the only
+ * writer of those buckets. Queues holds one queue from each tokenizer.
+*/
+typedef struct MarkovTrainOwner {
+  MarkovModel *model;
+  size_t tokenizer_count;
+  MarkovTrainQueue **queues;
+  pthread_t thread;
+} MarkovTrainOwner;
+
+/**
+ * The body of a training thread. Adds the records of its queues to its
+ * buckets until every tokenizer is done and the queues are drained.
+*/
+void *markov_train_owner_run(void *state) {
+  MarkovTrainOwner *owner = state;
+  MarkovModel *model = owner->model;
+  MarkovTrainRecord record;
+  MarkovContext context;
+  size_t open = owner->tokenizer_count;
+  while (open > 0) {
+    open = 0;
+    bool idle = true;
+    for (size_t i = 0; i < owner->tokenizer_count; ++i) {
+      /** Read done before draining, so records pushed before it are seen */
+      bool done = atomic_load_explicit(&owner->queues[i]->done, memory_order_acquire);
+      while (markov_train_queue_pop(owner->queues[i], &record)) {
+        memcpy(context.previous_words, record.previous_words,
+               sizeof(context.previous_words));
+        markov_model_insert(model, record.bucket, &context, record.word);
+        idle = false;
+      }
+      open += !done;
+    }
+    if (idle && open > 0) { sched_yield(); }
+  }
+  return NULL;
+}
+
+/**
+ * Loads a training file into a new MarkovModel with thread_count tokenizer
+ * threads and thread_count training threads. Each training thread owns a
+ * disjoint set of buckets, and tokenizers route each context and word to its
+ * owner through one single-producer, single-consumer queue per pair, so every
+ * bucket has a single writer and the partitions need no merging. Tokenizers
+ * read byte ranges of the file that start at quote boundaries. Returns NULL if
+ * the file could not be read. The caller is responsible for freeing the
+ * MarkovModel.
+*/
+MarkovModel *markov_model_load_file_partitioned(const char *file_name,
+                                                MarkovClasses *classes, MarkovOov *oov,
+                                                size_t thread_count) {
+  FILE *file = fopen(file_name, "r");
+  if (!file) {
+    perror("Unable to open file.");
+    return NULL;
+  }
+  long *bounds = malloc((thread_count + 1) * sizeof(long));
+  fseek(file, 0, SEEK_END);
+  long size = ftell(file);
+  bounds[0] = 0;
+  bounds[thread_count] = size;
+  char line[MARKOV_LINE_SIZE];
+  for (size_t t = 1; t < thread_count; ++t) {
+    /** Move each bound past the next blank line, so no quote is split */
+    fseek(file, size * t / thread_count, SEEK_SET);
+    fgets(line, sizeof(line), file);
+    while (fgets(line, sizeof(line), file) && line[strspn(line, " \t\r\n")] != '\0') {}
+    bounds[t] = ftell(file) > bounds[t - 1] ? ftell(file) : bounds[t - 1];
+  }
+  fclose(file);
+
+  MarkovModel *model = markov_model_new(HASH_MAP_SIZE);
+  MarkovTrainQueue **queues =
+      malloc(thread_count * thread_count * sizeof(MarkovTrainQueue *));
+  for (size_t i = 0; i < thread_count * thread_count; ++i) {
+    queues[i] = calloc(1, sizeof(MarkovTrainQueue));
+  }
+  MarkovTrainTokenizer *tokenizers = calloc(thread_count, sizeof(MarkovTrainTokenizer));
+  MarkovTrainOwner *owners = calloc(thread_count, sizeof(MarkovTrainOwner));
+  MarkovTrainQueue **owner_queues =
+      malloc(thread_count * thread_count * sizeof(MarkovTrainQueue *));
+  for (size_t o = 0; o < thread_count; ++o) {
+    for (size_t t = 0; t < thread_count; ++t) {
+      owner_queues[o * thread_count + t] = queues[t * thread_count + o];
+    }
+    owners[o].model = model;
+    owners[o].tokenizer_count = thread_count;
+    owners[o].queues = owner_queues + o * thread_count;
+    pthread_create(&owners[o].thread, NULL, markov_train_owner_run, &owners[o]);
+  }
+  for (size_t t = 0; t < thread_count; ++t) {
+    tokenizers[t].file_name = file_name;
+    tokenizers[t].start = bounds[t];
+    tokenizers[t].end = bounds[t + 1];
+    tokenizers[t].size = model->size;
+    tokenizers[t].owner_count = thread_count;
+    tokenizers[t].classes = classes;
+    tokenizers[t].oov = oov;
+    tokenizers[t].queues = queues + t * thread_count;
+    pthread_create(&tokenizers[t].thread, NULL, markov_train_tokenizer_run,
+                   &tokenizers[t]);
+  }
+  bool loaded = true;
+  for (size_t t = 0; t < thread_count; ++t) {
+    pthread_join(tokenizers[t].thread, NULL);
+    loaded = loaded && tokenizers[t].loaded;
+  }
+  for (size_t o = 0; o < thread_count; ++o) {
+    pthread_join(owners[o].thread, NULL);
+  }
+  for (size_t t = 0; t < thread_count; ++t) {
+    while (tokenizers[t].arena) {
+      MarkovWordArena *next = tokenizers[t].arena->next;
+      free(tokenizers[t].arena);
+      tokenizers[t].arena = next;
+    }
+  }
+  for (size_t i = 0; i < thread_count * thread_count; ++i) {
+    free(queues[i]);
+  }
+  free(owner_queues);
+  free(queues);
+  free(owners);
+  free(tokenizers);
+  free(bounds);
+  if (!loaded) {
+    markov_model_free(model);
+    return NULL;
+  }
+  return model;
+}
+
+/**
+ * Loads the data from a provided file into a MarkovModel object and returns a
+ * pointer to this object. If oov is not NULL, words removed by the vocabulary
+ * cap are replaced by OOV_WORD. If classes is not NULL, the model is trained
+ * over the class labels of the words. With TRAIN_THREAD_COUNT above 1 the
+ * file is loaded by markov_model_load_file_partitioned(). The caller is
+ * responsible for freeing the MarkovModel.
+*/
+MarkovModel *markov_model_load_file(const char *file_name, MarkovClasses *classes,
+                                    MarkovOov *oov) {
+  if (TRAIN_THREAD_COUNT > 1) {
+    return markov_model_load_file_partitioned(file_name, classes, oov,
+                                              TRAIN_THREAD_COUNT);
+  }
+  /** The insert batch tracks the running context and buffers the words until
+   * they are added to the model */
+  MarkovModel *model = markov_model_new(HASH_MAP_SIZE);
+  MarkovLoadState load = { model, markov_insert_batch_new(model), classes, oov };
+  bool loaded = markov_file_for_each_word(file_name, markov_model_load_word, &load);
+  markov_insert_batch_free(load.batch);
+  if (!loaded) {
+    markov_model_free(load.model);
+    return NULL;
+  }
+  return load.model;
+}
+
+/**
+ * Adds the quotes of a training file to an existing MarkovModel, tracking the
+ * changed nodes if the model tracks them. Returns false if the file could not
+ * be read.
+*/
+bool markov_model_add_file(MarkovModel *model, const char *file_name) {
+  MarkovLoadState load = { model, markov_insert_batch_new(model), NULL, NULL };
+  bool loaded = markov_file_for_each_word(file_name, markov_model_load_word, &load);
+  markov_insert_batch_free(load.batch);
+  return loaded;
+}
+
+/**
+ * Loads the quotes of a training file attributed to an author into a new
+ * MarkovModel. The caller is responsible for freeing the MarkovModel.
+*/
+MarkovModel *markov_model_load_author(const char *file_name, const char *author) {
+  MarkovModel *model = markov_model_new(HASH_MAP_SIZE);
+  MarkovLoadState load = { model, markov_insert_batch_new(model), NULL, NULL };
+  bool loaded = markov_file_for_each_word_by(file_name, author, markov_model_load_word,
+                                             &load);
+  markov_insert_batch_free(load.batch);
+  if (!loaded) {
+    markov_model_free(load.model);
+    return NULL;
+  }
+  return load.model;
+}
+
+/**
+ * The number of tab separated fields of a saved model table before the count:
+ * the context words, then the successor.
+*/
+#define MARKOV_TABLE_FIELDS (MARKOV_CONTEXT_SIZE + 1)
+
+/**
+ * A row of a saved model table. A table is a text file with one line per
+ * context and successor holding the MARKOV_CONTEXT_SIZE context words, the
+ * successor and its count separated by tabs. Empty context words stand for
+ * the start of a quote. Rows are sorted by their fields, compared in order
+ * with strcmp, so tables can be merged in one streaming pass. Fields point
+ * into line.
+*/
+typedef struct MarkovTableRow {
+  char *fields[MARKOV_TABLE_FIELDS];
+  long long count;
+  char line[MARKOV_TABLE_FIELDS * MARKOV_LINE_SIZE + 32];
+} MarkovTableRow;
+
+/**
+ * Compares the first field_count fields of two rows of a saved model table.
+ * Comparing MARKOV_CONTEXT_SIZE fields compares the contexts of the rows.
+*/
+int markov_table_row_compare_fields(const MarkovTableRow *a, const MarkovTableRow *b,
+                                    size_t field_count) {
+  for (size_t i = 0; i < field_count; ++i) {
+    int result = strcmp(a->fields[i], b->fields[i]);
+    if (result != 0) { return result; }
+  }
+  return 0;
+}
+
+/**
+ * Compares the fields of two rows of a saved model table. Returns a negative
+ * number, zero or a positive number like strcmp.
+*/
+int markov_table_row_compare(const MarkovTableRow *a, const MarkovTableRow *b) {
+  return markov_table_row_compare_fields(a, b, MARKOV_TABLE_FIELDS);
+}
+
+/**
+ * Compares the contexts of two rows of a saved model table like strcmp.
+*/
+int markov_table_row_compare_contexts(const MarkovTableRow *a,
+                                      const MarkovTableRow *b) {
+  return markov_table_row_compare_fields(a, b, MARKOV_CONTEXT_SIZE);
+}
+
+/**
+ * Copies a row of a saved model table, pointing the fields of the copy into
+ * its own line.
+*/
+void markov_table_row_copy(MarkovTableRow *to, const MarkovTableRow *from) {
+  memcpy(to->line, from->line, sizeof(to->line));
+  for (size_t i = 0; i < MARKOV_TABLE_FIELDS; ++i) {
+    to->fields[i] = to->line + (from->fields[i] - from->line);
+  }
+  to->count = from->count;
+}
+
+/**
+ * Splits the line of a row of a saved model table into its fields and count.
+ * Returns false if the line is malformed.
+*/
+bool markov_table_row_parse(MarkovTableRow *row) {
+  char *cursor = row->line;
+  for (size_t i = 0; i < MARKOV_TABLE_FIELDS; ++i) {
+    row->fields[i] = cursor;
+    cursor = strchr(cursor, '\t');
+    if (!cursor) { return false; }
+    *cursor++ = '\0';
+  }
+  char *end;
+  row->count = strtoll(cursor, &end, 10);
+  return end != cursor && (*end == '\n' || *end == '\0')
+      && row->fields[MARKOV_CONTEXT_SIZE][0] != '\0';
+}
+
+/**
+ * Writes a row of a saved model table to a file.
+*/
+void markov_table_row_write(FILE *file, char **fields, long long count) {
+  for (size_t i = 0; i < MARKOV_TABLE_FIELDS; ++i) {
+    fputs(fields[i], file);
+    fputc('\t', file);
+  }
+  fprintf(file, "%lld\n", count);
+}
+
+/**
+ * A cursor over the rows of a saved model table. Previous holds the last row
+ * read so that unsorted input is detected instead of silently merged wrong.
+*/
+typedef struct MarkovTableReader {
+  FILE *file;
+  const char *file_name;
+  size_t line_number;
+  bool failed;
+  MarkovTableRow row;
+  MarkovTableRow previous;
+} MarkovTableReader;
+
+/**
+ * Returns a new MarkovTableReader over a saved model table, or NULL if the
+ * file could not be opened. The caller is responsible for freeing the reader
+ * with markov_table_reader_free().
+*/
+MarkovTableReader *markov_table_reader_new(const char *file_name) {
+  FILE *file = fopen(file_name, "r");
+  if (!file) {
+    perror("Unable to open file.");
+    return NULL;
+  }
+  MarkovTableReader *reader = calloc(1, sizeof(MarkovTableReader));
+  reader->file = file;
+  reader->file_name = file_name;
+  return reader;
+}
+
+/**
+ * Reads the next row of a saved model table into reader->row. Returns false at
+ * the end of the table, or if the row is malformed or out of order, in which
+ * case failed is set and an error is printed.
+*/
+bool markov_table_reader_next(MarkovTableReader *reader) {
+  if (reader->line_number > 0) {
+    markov_table_row_copy(&reader->previous, &reader->row);
+  }
+  MarkovTableRow *row = &reader->row;
+  if (!fgets(row->line, sizeof(row->line), reader->file)) { return false; }
+  reader->line_number++;
+  if (!markov_table_row_parse(row)) {
+    fprintf(stderr, "%s:%zu: malformed row\n", reader->file_name, reader->line_number);
+    reader->failed = true;
+    return false;
+  }
+  if (reader->line_number > 1
+      && markov_table_row_compare(&reader->previous, row) >= 0) {
+    fprintf(stderr, "%s:%zu: row out of order\n", reader->file_name,
+            reader->line_number);
+    reader->failed = true;
+    return false;
+  }
+  return true;
+}
+
+/**
+ * Moves a file to the start of the first line starting at or after offset.
+*/
+void markov_table_skip_to_line(FILE *file, long offset) {
+  if (offset == 0) {
+    fseek(file, 0, SEEK_SET);
+    return;
+  }
+  fseek(file, offset - 1, SEEK_SET);
+  int c = fgetc(file);
+  while (c != '\n' && c != EOF) {
+    c = fgetc(file);
+  }
+}
+
+/**
+ * Moves a MarkovTableReader to the first row whose context is not below the
+ * context of key, found by binary search over byte offsets, and reads it into
+ * reader->row. Line numbers in errors then count from that row. Returns false
+ * if there is no such row or it could not be read.
+*/
+bool markov_table_reader_seek(MarkovTableReader *reader, const MarkovTableRow *key) {
+  fseek(reader->file, 0, SEEK_END);
+  long low = 0;
+  long high = ftell(reader->file);
+  MarkovTableRow *row = &reader->row;
+  /** Find the smallest offset whose next line starts at or after the key */
+  while (low < high) {
+    long middle = low + (high - low) / 2;
+    markov_table_skip_to_line(reader->file, middle);
+    bool before = fgets(row->line, sizeof(row->line), reader->file)
+        && markov_table_row_parse(row)
+        && markov_table_row_compare_contexts(row, key) < 0;
+    if (before) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+  markov_table_skip_to_line(reader->file, low);
+  reader->line_number = 0;
+  return markov_table_reader_next(reader);
+}
+
+/**
+ * Frees all the data associated with a MarkovTableReader.
+*/
+void markov_table_reader_free(MarkovTableReader *reader) {
+  if (!reader) { return; }
+  fclose(reader->file);
+  free(reader);
+}
+
+/**
+ * A context and successor of a MarkovModel, sorted to save the model.
+*/
+typedef struct MarkovTableEntry {
+  MarkovContext *context;
+  MarkovValue *value;
+} MarkovTableEntry;
+
+/**
+ * Compares two MarkovTableEntry instances in the row order of a saved model
+ * table. Used with qsort.
+*/
+int markov_table_entry_compare(const void *a, const void *b) {
+  const MarkovTableEntry *entry_a = a;
+  const MarkovTableEntry *entry_b = b;
+  for (size_t i = 0; i < MARKOV_CONTEXT_SIZE; ++i) {
+    char *word_a = entry_a->context->previous_words[i];
+    char *word_b = entry_b->context->previous_words[i];
+    int result = strcmp(word_a ? word_a : "", word_b ? word_b : "");
+    if (result != 0) { return result; }
+  }
+  return strcmp(entry_a->value->word, entry_b->value->word);
+}
+
+/**
+ * Saves a MarkovModel as a sorted model table.
+ *
+ * @return Returns false if the file could not be written.
+*/
+bool markov_model_save(MarkovModel *model, const char *file_name) {
+  size_t entry_count = 0;
+  for (size_t i = 0; i < model->size; ++i) {
+    for (MarkovNode *node = model->nodes[i]; node; node = node->next) {
+      for (MarkovValue *value = node->value; value; value = value->next) {
+        entry_count++;
+      }
+    }
+  }
+  MarkovTableEntry *entries = malloc((entry_count + 1) * sizeof(MarkovTableEntry));
+  MarkovTableEntry *entry = entries;
+  for (size_t i = 0; i < model->size; ++i) {
+    for (MarkovNode *node = model->nodes[i]; node; node = node->next) {
+      for (MarkovValue *value = node->value; value; value = value->next) {
+        entry->context = node->context;
+        entry->value = value;
+        entry++;
+      }
+    }
+  }
+  qsort(entries, entry_count, sizeof(MarkovTableEntry), markov_table_entry_compare);
+
+  FILE *file = fopen(file_name, "w");
+  if (!file) {
+    perror("Unable to open file.");
+    free(entries);
+    return false;
+  }
+  char *fields[MARKOV_TABLE_FIELDS];
+  for (size_t i = 0; i < entry_count; ++i) {
+    for (size_t j = 0; j < MARKOV_CONTEXT_SIZE; ++j) {
+      char *word = entries[i].context->previous_words[j];
+      fields[j] = word ? word : "";
+    }
+    fields[MARKOV_CONTEXT_SIZE] = entries[i].value->word;
+    markov_table_row_write(file, fields, entries[i].value->count);
+  }
+  free(entries);
+  return fclose(file) == 0;
+}
+
+/**
+ * Adds count occurrences of a word after a context to a MarkovModel.
+*/
+void markov_model_add_count(MarkovModel *model, MarkovContext *context, char *word,
+                            size_t count) {
+  size_t index = markov_context_get_hash(context) % model->size;
+  markov_model_insert(model, index, context, word);
+  MarkovNode *node = model->nodes[index];
+  while (!markov_context_check_match(node->context, context)) {
+    node = node->next;
+  }
+  MarkovValue *value = node->value;
+  while (strcmp(value->word, word) != 0) {
+    value = value->next;
+  }
+  /** The node already counted one occurrence, or more for a repeated row */
+  value->count += count - 1;
+}
+
+/**
+ * Loads a saved model table into a new MarkovModel. Rows with a count below 1
+ * are skipped. Returns NULL if the table could not be read. The caller is
+ * responsible for freeing the MarkovModel.
+*/
+MarkovModel *markov_model_load_table(const char *file_name) {
+  MarkovTableReader *reader = markov_table_reader_new(file_name);
+  if (!reader) { return NULL; }
+  MarkovModel *model = markov_model_new(HASH_MAP_SIZE);
+  MarkovContext context;
+  while (markov_table_reader_next(reader)) {
+    if (reader->row.count < 1) { continue; }
+    for (size_t i = 0; i < MARKOV_CONTEXT_SIZE; ++i) {
+      char *word = reader->row.fields[i];
+      context.previous_words[i] = word[0] ? word : NULL;
+    }
+    markov_model_add_count(model, &context, reader->row.fields[MARKOV_CONTEXT_SIZE],
+                           reader->row.count);
+  }
+  bool failed = reader->failed;
+  markov_table_reader_free(reader);
+  if (failed) {
+    markov_model_free(model);
+    return NULL;
+  }
+  return model;
+}
+
+/**
+ * Restores the heap property of a min-heap of table readers, ordered by their
+ * current rows, by moving the reader at the given position down.
+*/
+void markov_table_heap_sift_down(MarkovTableReader **heap, size_t count,
+                                 size_t position) {
+  while (true) {
+    size_t smallest = position;
+    size_t left = 2 * position + 1;
+    size_t right = left + 1;
+    if (left < count
+        && markov_table_row_compare(&heap[left]->row, &heap[smallest]->row) < 0) {
+      smallest = left;
+    }
+    if (right < count
+        && markov_table_row_compare(&heap[right]->row, &heap[smallest]->row) < 0) {
+      smallest = right;
+    }
+    if (smallest == position) { return; }
+    MarkovTableReader *temp = heap[position];
+    heap[position] = heap[smallest];
+    heap[smallest] = temp;
+    position = smallest;
+  }
+}
+
+/**
+ * Merges any number of saved model tables into one by adding the counts of
+ * equal rows. The tables are streamed through a k-way merge, so memory use
+ * depends on the number of tables, not their size, and the tables may use
+ * different vocabularies. Rows whose total count is below 1 are dropped, so a
+ * delta table with negative counts can retract rows from a base table.
+ *
+ * @return Returns false if a table could not be read or the output written.
+*/
+bool markov_table_merge(char **input_names, size_t input_count,
+                        const char *output_name) {
+  MarkovTableReader **heap = calloc(input_count + 1, sizeof(MarkovTableReader *));
+  MarkovTableReader **readers = calloc(input_count + 1, sizeof(MarkovTableReader *));
+  bool ok = true;
+  size_t count = 0;
+  for (size_t i = 0; i < input_count && ok; ++i) {
+    readers[i] = markov_table_reader_new(input_names[i]);
+    ok = readers[i] != NULL;
+    if (ok && markov_table_reader_next(readers[i])) {
+      heap[count++] = readers[i];
+    }
+  }
+  for (size_t i = count; i-- > 0;) {
+    markov_table_heap_sift_down(heap, count, i);
+  }
+  FILE *output = ok ? fopen(output_name, "w") : NULL;
+  if (ok && !output) {
+    perror("Unable to open file.");
+    ok = false;
+  }
+
+  MarkovTableRow *merged = malloc(sizeof(MarkovTableRow));
+  while (ok && count > 0) {
+    markov_table_row_copy(merged, &heap[0]->row);
+    merged->count = 0;
+    while (count > 0 && markov_table_row_compare(&heap[0]->row, merged) == 0) {
+      merged->count += heap[0]->row.count;
+      if (!markov_table_reader_next(heap[0])) {
+        heap[0] = heap[--count];
+      }
+      markov_table_heap_sift_down(heap, count, 0);
+    }
+    if (merged->count > 0) {
+      markov_table_row_write(output, merged->fields, merged->count);
+    }
+  }
+  for (size_t i = 0; i < input_count; ++i) {
+    ok = ok && !(readers[i] && readers[i]->failed);
+    markov_table_reader_free(readers[i]);
+  }
+  if (output) {
+    ok = fclose(output) == 0 && ok;
+  }
+  free(merged);
+  free(readers);
+  free(heap);
+  return ok;
+}
+
+/**
+ * Returns the context of a row of a saved model table as its words separated
+ * by spaces, with <s> standing for the start of a quote. The caller is
+ * responsible for freeing the returned string.
+*/
+char *markov_table_row_context_string(const MarkovTableRow *row) {
+  size_t length = 1;
+  for (size_t i = 0; i < MARKOV_CONTEXT_SIZE; ++i) {
+    length += strlen(row->fields[i]) + 4;
+  }
+  char *context = malloc(length);
+  context[0] = '\0';
+  for (size_t i = 0; i < MARKOV_CONTEXT_SIZE; ++i) {
+    if (i > 0) { strcat(context, " "); }
+    strcat(context, row->fields[i][0] ? row->fields[i] : "<s>");
+  }
+  return context;
+}
+
+/**
+ * Adds item to a bounded min-heap of count items of size bytes, holding the
+ * capacity items that sort first with compare, a qsort comparison that sorts
+ * the best items first. Items must have room for capacity + 1 items; the last
+ * is scratch space. When the heap is full, item replaces the root if it sorts
+ * before it. Returns true if an item was dropped, either item itself or the
+ * root it replaced, and leaves a copy of the dropped item in item so that the
+ * caller can free what it owns.
+*/
+bool markov_top_heap_add(void *items, size_t *count, size_t capacity, size_t size,
+                         void *item, int (*compare)(const void *, const void *)) {
+  char *heap = items;
+  size_t position;
+  if (*count < capacity) {
+    position = (*count)++;
+    while (position > 0 && compare(heap + (position - 1) / 2 * size, item) < 0) {
+      memcpy(heap + position * size, heap + (position - 1) / 2 * size, size);
+      position = (position - 1) / 2;
+    }
+    memcpy(heap + position * size, item, size);
+    return false;
+  }
+  if (capacity == 0 || compare(item, heap) >= 0) { return true; }
+  char *root = heap + capacity * size;
+  memcpy(root, heap, size);
+  position = 0;
+  while (true) {
+    size_t child = 2 * position + 1;
+    if (child >= *count) { break; }
+    if (child + 1 < *count
+        && compare(heap + (child + 1) * size, heap + child * size) > 0) { child++; }
+    if (compare(heap + child * size, item) <= 0) { break; }
+    memcpy(heap + position * size, heap + child * size, size);
+    position = child;
+  }
+  memcpy(heap + position * size, item, size);
+  memcpy(item, root, size);
+  return true;
+}
+
+/**
+ * A context whose successor distribution differs between two saved model
+ * tables, with the Jensen-Shannon divergence of the two distributions in bits
+ * and the total count of the context in each table. Score, the divergence
+ * weighted by the combined count, orders the drift report.
+*/
+typedef struct MarkovDriftContext {
+  double score;
+  double divergence;
+  long long old_count;
+  long long new_count;
+  char *context;
+} MarkovDriftContext;
+
+/**
+ * One thread's share of the comparison of two saved model tables: the
+ * contexts from the context of first, or the start of the tables if NULL, up
+ * to but excluding the context of last, or the end if NULL. The sums are
+ * weighted by context counts and normalized once every thread is done. Top is
+ * a min-heap by score of the DRIFT_TOP_CONTEXTS most drifting contexts. When
+ * keep_all is set, every drifting context is appended to all instead, to check
+ * the heap against a full sort.
+*/
+typedef struct MarkovDriftTask {
+  const char *old_name;
+  const char *new_name;
+  const MarkovTableRow *first;
+  const MarkovTableRow *last;
+  size_t kept;
+  size_t added;
+  size_t removed;
+  long long old_total;
+  long long new_total;
+  long long kept_old_total;
+  double kl_sum;
+  double old_js_sum;
+  double new_js_sum;
+  size_t top_count;
+  MarkovDriftContext top[DRIFT_TOP_CONTEXTS + 1];
+  bool keep_all;
+  size_t all_count;
+  size_t all_capacity;
+  MarkovDriftContext *all;
+  bool failed;
+  pthread_t thread;
+} MarkovDriftTask;
+
+/**
+ * Returns the Jensen-Shannon divergence in bits between the successor counts
+ * of a context in two tables, given as aligned arrays with their totals, and
+ * sets kl to the Kullback-Leibler divergence of the old distribution from the
+ * new one, with DRIFT_SMOOTHING added to every count so it stays finite.
+*/
+double markov_drift_divergence(const long long *old_counts, const long long *new_counts,
+                               size_t count, long long old_total, long long new_total,
+                               double *kl) {
+  double divergence = 0.0;
+  *kl = 0.0;
+  double old_smoothed_total = old_total + DRIFT_SMOOTHING * count;
+  double new_smoothed_total = new_total + DRIFT_SMOOTHING * count;
+  for (size_t i = 0; i < count; ++i) {
+    double p = (double)old_counts[i] / old_total;
+    double q = (double)new_counts[i] / new_total;
+    double mean = (p + q) / 2.0;
+    if (p > 0.0) { divergence += 0.5 * p * log2(p / mean); }
+    if (q > 0.0) { divergence += 0.5 * q * log2(q / mean); }
+    double p_smoothed = (old_counts[i] + DRIFT_SMOOTHING) / old_smoothed_total;
+    double q_smoothed = (new_counts[i] + DRIFT_SMOOTHING) / new_smoothed_total;
+    *kl += p_smoothed * log2(p_smoothed / q_smoothed);
+  }
+  return divergence;
+}
+
+/**
+ * Compares two MarkovDriftContext instances by descending score. Used with
+ * qsort.
+*/
+int markov_drift_context_compare(const void *a, const void *b) {
+  double score_a = ((const MarkovDriftContext *)a)->score;
+  double score_b = ((const MarkovDriftContext *)b)->score;
+  return (score_a < score_b) - (score_a > score_b);
+}
+
+/**
+ * Adds a context to the top drifting contexts of a MarkovDriftTask if its
+ * score is high enough, or to all of them if the task keeps all. Takes
+ * ownership of the context string.
+*/
+void markov_drift_task_add_top(MarkovDriftTask *task, MarkovDriftContext drift) {
+  if (task->keep_all) {
+    if (task->all_count == task->all_capacity) {
+      task->all_capacity = task->all_capacity ? task->all_capacity * 2 : 64;
+      task->all = realloc(task->all, task->all_capacity * sizeof(MarkovDriftContext));
+    }
+    task->all[task->all_count++] = drift;
+    return;
+  }
+  if (markov_top_heap_add(task->top, &task->top_count, DRIFT_TOP_CONTEXTS,
+                          sizeof(MarkovDriftContext), &drift,
+                          markov_drift_context_compare)) {
+    free(drift.context);
+  }
+}
+
+/**
+ * The body of a drift thread. Merge joins the rows of its range of the two
+ * tables context by context, and within a context successor by successor.
+*/
+void *markov_drift_run(void *state) {
+  MarkovDriftTask *task = state;
+  MarkovTableReader *old = markov_table_reader_new(task->old_name);
+  MarkovTableReader *new = markov_table_reader_new(task->new_name);
+  if (!old || !new) {
+    task->failed = true;
+    markov_table_reader_free(old);
+    markov_table_reader_free(new);
+    return NULL;
+  }
+  const MarkovTableRow *first = task->first;
+  const MarkovTableRow *last = task->last;
+  bool old_valid = first ? markov_table_reader_seek(old, first)
+                         : markov_table_reader_next(old);
+  bool new_valid = first ? markov_table_reader_seek(new, first)
+                         : markov_table_reader_next(new);
+  MarkovTableRow *context = malloc(sizeof(MarkovTableRow));
+  size_t capacity = 16;
+  long long *old_counts = malloc(capacity * sizeof(long long));
+  long long *new_counts = malloc(capacity * sizeof(long long));
+  while (true) {
+    old_valid = old_valid
+        && (!last || markov_table_row_compare_contexts(&old->row, last) < 0);
+    new_valid = new_valid
+        && (!last || markov_table_row_compare_contexts(&new->row, last) < 0);
+    if (!old_valid && !new_valid) { break; }
+    bool old_leads = !new_valid
+        || (old_valid && markov_table_row_compare_contexts(&old->row, &new->row) <= 0);
+    markov_table_row_copy(context, old_leads ? &old->row : &new->row);
+
+    size_t count = 0;
+    long long old_total = 0;
+    long long new_total = 0;
+    while (true) {
+      bool old_here = old_valid
+          && markov_table_row_compare_contexts(&old->row, context) == 0;
+      bool new_here = new_valid
+          && markov_table_row_compare_contexts(&new->row, context) == 0;
+      if (!old_here && !new_here) { break; }
+      int order = !old_here ? 1 : !new_here ? -1 :
+                  strcmp(old->row.fields[MARKOV_CONTEXT_SIZE],
+                         new->row.fields[MARKOV_CONTEXT_SIZE]);
+      if (count == capacity) {
+        capacity *= 2;
+        old_counts = realloc(old_counts, capacity * sizeof(long long));
+        new_counts = realloc(new_counts, capacity * sizeof(long long));
+      }
+      old_counts[count] = order <= 0 && old->row.count > 0 ? old->row.count : 0;
+      new_counts[count] = order >= 0 && new->row.count > 0 ? new->row.count : 0;
+      old_total += old_counts[count];
+      new_total += new_counts[count];
+      count++;
+      if (order <= 0) { old_valid = markov_table_reader_next(old); }
+      if (order >= 0) { new_valid = markov_table_reader_next(new); }
+    }
+
+    double divergence = 1.0;
+    if (old_total > 0 && new_total > 0) {
+      double kl;
+      divergence = markov_drift_divergence(old_counts, new_counts, count, old_total,
+                                           new_total, &kl);
+      task->kept++;
+      task->kept_old_total += old_total;
+      task->kl_sum += old_total * kl;
+    } else if (old_total > 0) {
+      task->removed++;
+    } else if (new_total > 0) {
+      task->added++;
+    } else {
+      continue;
+    }
+    task->old_total += old_total;
+    task->new_total += new_total;
+    task->old_js_sum += old_total * divergence;
+    task->new_js_sum += new_total * divergence;
+    if (divergence > 0.0) {
+      MarkovDriftContext drift = {
+        divergence * (old_total + new_total), divergence, old_total, new_total,
+        markov_table_row_context_string(context)
+      };
+      markov_drift_task_add_top(task, drift);
+    }
+  }
+  task->failed = old->failed || new->failed;
+  free(old_counts);
+  free(new_counts);
+  free(context);
+  markov_table_reader_free(old);
+  markov_table_reader_free(new);
+  return NULL;
+}
+
+/**
+ * Returns the number of the first top_count entries of top, sorted by
+ * descending score, whose score differs from that of the same rank in a full
+ * sort of every drifting context of two saved model tables, plus the
+ * difference in length if top holds fewer than DRIFT_TOP_CONTEXTS entries
+ * but more contexts drifted. Used to check the heaps of the drift threads.
+*/
+size_t markov_drift_check_top(const char *old_name, const char *new_name,
+                              const MarkovDriftContext *top, size_t top_count) {
+  MarkovDriftTask task = {
+    .old_name = old_name, .new_name = new_name, .keep_all = true
+  };
+  markov_drift_run(&task);
+  qsort(task.all, task.all_count, sizeof(MarkovDriftContext),
+        markov_drift_context_compare);
+  size_t expected = task.all_count < DRIFT_TOP_CONTEXTS ? task.all_count
+                                                        : DRIFT_TOP_CONTEXTS;
+  size_t wrong = expected > top_count ? expected - top_count : top_count - expected;
+  for (size_t i = 0; i < expected && i < top_count; ++i) {
+    if (top[i].score != task.all[i].score) { wrong++; }
+  }
+  for (size_t i = 0; i < task.all_count; ++i) {
+    free(task.all[i].context);
+  }
+  free(task.all);
+  return wrong;
+}
+
+/**
+ * Compares two saved model tables, such as last week's model and this week's,
+ * and prints the contexts kept, added and removed, the KL divergence of the
+ * old successor distributions from the new ones over kept contexts, the JS
+ * divergence over all contexts, both weighted by context counts, and the
+ * DRIFT_TOP_CONTEXTS most drifting contexts. The tables are split into
+ * thread_count ranges of contexts at keys sampled from the old table, and
+ * each thread merge joins its range of both tables. With BENCHMARK_QUOTE_COUNT
+ * set, the most drifting contexts are checked against a full sort.
+ *
+ * @return Returns false if a table could not be read.
+*/
+bool markov_table_report_drift(const char *old_name, const char *new_name,
+                               size_t thread_count) {
+  MarkovTableReader *sampler = markov_table_reader_new(old_name);
+  if (!sampler) { return false; }
+  fseek(sampler->file, 0, SEEK_END);
+  long size = ftell(sampler->file);
+  MarkovTableRow *splits = calloc(thread_count, sizeof(MarkovTableRow));
+  size_t range_count = 1;
+  while (range_count < thread_count) {
+    markov_table_skip_to_line(sampler->file, size * range_count / thread_count);
+    MarkovTableRow *split = &splits[range_count];
+    if (!fgets(split->line, sizeof(split->line), sampler->file)
+        || !markov_table_row_parse(split)) { break; }
+    range_count++;
+  }
+  markov_table_reader_free(sampler);
+
+  MarkovDriftTask *tasks = calloc(range_count, sizeof(MarkovDriftTask));
+  for (size_t i = 0; i < range_count; ++i) {
+    tasks[i].old_name = old_name;
+    tasks[i].new_name = new_name;
+    tasks[i].first = i > 0 ? &splits[i] : NULL;
+    tasks[i].last = i + 1 < range_count ? &splits[i + 1] : NULL;
+    pthread_create(&tasks[i].thread, NULL, markov_drift_run, &tasks[i]);
+  }
+  MarkovDriftTask total = { 0 };
+  MarkovDriftContext *top =
+      malloc(range_count * DRIFT_TOP_CONTEXTS * sizeof(MarkovDriftContext));
+  for (size_t i = 0; i < range_count; ++i) {
+    pthread_join(tasks[i].thread, NULL);
+    total.failed = total.failed || tasks[i].failed;
+    total.kept += tasks[i].kept;
+    total.added += tasks[i].added;
+    total.removed += tasks[i].removed;
+    total.old_total += tasks[i].old_total;
+    total.new_total += tasks[i].new_total;
+    total.kept_old_total += tasks[i].kept_old_total;
+    total.kl_sum += tasks[i].kl_sum;
+    total.old_js_sum += tasks[i].old_js_sum;
+    total.new_js_sum += tasks[i].new_js_sum;
+    memcpy(top + total.top_count, tasks[i].top,
+           tasks[i].top_count * sizeof(MarkovDriftContext));
+    total.top_count += tasks[i].top_count;
+  }
+  if (!total.failed) {
+    printf("%zu contexts kept, %zu added, %zu removed\n", total.kept, total.added,
+           total.removed);
+    printf("KL(old || new) %.6f bits over kept contexts, JS %.6f bits\n",
+           total.kept_old_total ? total.kl_sum / total.kept_old_total : 0.0,
+           ((total.old_total ? total.old_js_sum / total.old_total : 0.0) +
+            (total.new_total ? total.new_js_sum / total.new_total : 0.0)) / 2.0);
+    qsort(top, total.top_count, sizeof(MarkovDriftContext),
+          markov_drift_context_compare);
+    size_t shown = total.top_count < DRIFT_TOP_CONTEXTS ? total.top_count
+                                                        : DRIFT_TOP_CONTEXTS;
+    for (size_t i = 0; i < shown; ++i) {
+      printf("  JS %.4f  %lld -> %lld  %s\n", top[i].divergence, top[i].old_count,
+             top[i].new_count, top[i].context);
+    }
+    if (BENCHMARK_QUOTE_COUNT) {
+      size_t wrong = markov_drift_check_top(old_name, new_name, top, shown);
+      fprintf(stderr, "drift check: %zu of %zu top contexts differ from a full sort\n",
+              wrong, shown);
+    }
+  }
+  for (size_t i = 0; i < total.top_count; ++i) {
+    free(top[i].context);
+  }
+  free(top);
+  free(tasks);
+  free(splits);
+  return !total.failed;
+}
+
+/**
+ * When given a context, returns a possible next word based upon the data in a
+ * provided model. The caller is responsible for updating the context.
+*/
+char *markov_model_get_next(MarkovModel *model, MarkovContext *context) {
+  MarkovNode *node = model->nodes[markov_context_get_hash(context) % model->size];
+  char *word = NULL;
+  while (node) {
+    if (markov_context_check_match(node->context, context)) {
+      word = markov_value_get_random(node->value);
+      return word;
+    }
+    node = node->next;
+  }
+  return word;
+}
+
+/**
+ * Returns true if a word contains specific end conditions (. or ! or ?).
+*/
+bool check_end_condition(char *word) {
+  if (strchr(word, '.') || strchr(word, '!') || strchr(word, '?')) {
+    return true;
+  }
+  return false;
+}
+
+/**
+ * Returns a pointer to a given quote with the given word appended. The caller
+ * is responsible for freeing the quote.
+*/
+char *add_word_to_quote(char *quote, char *word) {
+  if (quote == NULL || word == NULL) {
+    return quote;
+  }
+  size_t length = strlen(quote) + strlen(word) + 2;
+  quote = realloc(quote, length);
+  if (quote[0] != '\0') {
+    strcat(quote, " ");
+  }
+  strcat(quote, word);
+  return quote;
+}
+
+/**
+ * Returns a quote based upon the contained in the given MarkovModel.
+*/
+char *markov_model_generate_quote(MarkovModel *model) {
+  MarkovContext *context = markov_context_new();
+  size_t counter = 0;
+  char *quote = calloc(1, 1);
+  while (counter <= MAX_QUOTE_LENGTH) {
+    char *word = markov_model_get_next(model, context);
+    context = markov_context_push_word(context, word);
+    if (!word) { break; }
+    quote = add_word_to_quote(quote, word);
+    if (check_end_condition(word)) { break; }
+    counter++;
+  }
+  markov_context_free(context);
+  return quote;
+}
+
+/**
+ * Returns the current time in seconds from a monotonic clock. Used to measure
+ * generation latency.
+*/
+double get_time_seconds(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+}
+
+/**
+ * A histogram of latencies in nanoseconds with logarithmic buckets: four
+ * buckets per power of two, so percentiles are accurate to within 25%.
+*/
+typedef struct MarkovLatencyHistogram {
+  size_t count;
+  size_t buckets[64 * 4];
+} MarkovLatencyHistogram;
+
+/**
+ * Records one latency, in nanoseconds, in a MarkovLatencyHistogram.
+*/
+void markov_histogram_record(MarkovLatencyHistogram *histogram, uint64_t nanoseconds) {
+  size_t bucket = nanoseconds;
+  if (nanoseconds >= 4) {
+    int exponent = 63 - __builtin_clzll(nanoseconds);
+    bucket = exponent * 4 + ((nanoseconds >> (exponent - 2)) & 3);
+  }
+  histogram->buckets[bucket]++;
+  histogram->count++;
+}
+
+/**
+ * Returns the lower bound, in nanoseconds, of the bucket holding the given
+ * percentile (0 to 100) of a MarkovLatencyHistogram.
+*/
+uint64_t markov_histogram_percentile(MarkovLatencyHistogram *histogram,
+                                     double percentile) {
+  size_t rank = (size_t)ceil(histogram->count * percentile / 100.0);
+  size_t seen = 0;
+  for (size_t bucket = 0; bucket < 64 * 4; ++bucket) {
+    seen += histogram->buckets[bucket];
+    if (seen >= rank && seen > 0) {
+      if (bucket < 4) { return bucket; }
+      size_t exponent = bucket / 4;
+      return ((uint64_t)1 << exponent) + ((uint64_t)(bucket % 4) << (exponent - 2));
+    }
+  }
+  return 0;
+}
+
+/**
+ * Adds every recorded latency of one MarkovLatencyHistogram to another.
+*/
+void markov_histogram_merge(MarkovLatencyHistogram *into,
+                            MarkovLatencyHistogram *from) {
+  for (size_t bucket = 0; bucket < 64 * 4; ++bucket) {
+    into->buckets[bucket] += from->buckets[bucket];
+  }
+  into->count += from->count;
+}
+
+/**
+ * A context of the MarkovFrozen model. Words are stored as vocabulary ids and
+ * the successors of the context are stored as a contiguous block of the
+ * successor array starting at first.
+*/
+typedef struct MarkovFrozenContext {
+  uint32_t words[MARKOV_CONTEXT_SIZE];
+  uint32_t first;
+  uint32_t length;
+  uint32_t total;
+} MarkovFrozenContext;
+
+/**
+ * A successor of a MarkovFrozenContext. Cumulative holds the sum of the counts
+ * of this successor and all successors before it in the block, so sampling is
+ * a binary search.
+*/
+typedef struct MarkovFrozenSuccessor {
+  uint32_t word;
+  uint32_t cumulative;
+} MarkovFrozenSuccessor;
+
+/**
+ * A decompressed page held by the cache of a MarkovPageStore. Pins counts the
+ * readers currently using the successors; pinned entries are never evicted.
+*/
+typedef struct MarkovPageEntry {
+  uint32_t page;
+  uint32_t pins;
+  struct MarkovPageEntry *prev;
+  struct MarkovPageEntry *next;
+  MarkovFrozenSuccessor *successors;
+} MarkovPageEntry;
+
+/**
+ * One shard of the decompression cache of a MarkovPageStore, holding the pages
+ * whose index modulo PAGE_CACHE_SHARDS equals the shard index. Entries form a
+ * doubly linked list from the most (head) to the least (tail) recently used.
+*/
+typedef struct MarkovPageShard {
+  pthread_mutex_t lock;
+  MarkovPageEntry *head;
+  MarkovPageEntry *tail;
+  size_t hits;
+  size_t misses;
+  MarkovLatencyHistogram latency;
+} MarkovPageShard;
+
+/**
+ * Successor data of a MarkovFrozen model stored as compressed pages with a
+ * sharded LRU cache of decompressed pages in front. Each page holds whole
+ * successor blocks, about PAGE_TARGET_SUCCESSORS successors, encoded as
+ * varints: the word id, then the zigzag encoded difference between its
+ * cumulative count and the previous one. Resident maps each page to its cache
+ * entry, or NULL, and is protected by the lock of the page's shard.
+*/
+typedef struct MarkovPageStore {
+  size_t page_count;
+  uint32_t *page_first;
+  uint32_t *page_lengths;
+  size_t *page_offsets;
+  uint8_t *data;
+  uint32_t max_page_length;
+  MarkovPageEntry **resident;
+  MarkovPageShard shards[PAGE_CACHE_SHARDS];
+} MarkovPageStore;
+
+/**
+ * Appends an unsigned varint to a byte buffer and returns the new length.
+*/
+size_t write_varint(uint8_t *data, size_t length, uint64_t value) {
+  while (value >= 0x80) {
+    data[length++] = (uint8_t)(value | 0x80);
+    value >>= 7;
+  }
+  data[length++] = (uint8_t)value;
+  return length;
+}
+
+/**
+ * Reads an unsigned varint from a byte buffer, advancing the cursor past it.
+*/
+uint64_t read_varint(const uint8_t **cursor) {
+  uint64_t value = 0;
+  int shift = 0;
+  uint8_t byte;
+  do {
+    byte = *(*cursor)++;
+    value |= (uint64_t)(byte & 0x7f) << shift;
+    shift += 7;
+  } while (byte & 0x80);
+  return value;
+}
+
+/**
+ * Compresses an array of successors into a new MarkovPageStore whose cache
+ * holds cache_pages decompressed pages. Pages are cut at the boundaries of the
+ * given contexts, so a block never spans two pages. The caller is responsible
+ * for freeing the store with markov_page_store_free().
+*/
+MarkovPageStore *markov_page_store_new(MarkovFrozenSuccessor *successors,
+                                       MarkovFrozenContext *contexts,
+                                       size_t context_count, size_t cache_pages) {
+  MarkovPageStore *store = calloc(1, sizeof(MarkovPageStore));
+  size_t successor_count = 0;
+  for (size_t i = 0; i < context_count; ++i) {
+    successor_count += contexts[i].length;
+  }
+  bool *starts = calloc(successor_count + 1, sizeof(bool));
+  for (size_t i = 0; i < context_count; ++i) {
+    starts[contexts[i].first] = true;
+  }
+  size_t page_capacity = 16;
+  store->page_first = malloc(page_capacity * sizeof(uint32_t));
+  store->page_lengths = malloc(page_capacity * sizeof(uint32_t));
+  store->page_offsets = malloc((page_capacity + 1) * sizeof(size_t));
+  store->data = malloc(successor_count * 20 + 1);
+  size_t length = 0;
+  uint32_t first = 0;
+  while (first < successor_count) {
+    if (store->page_count == page_capacity) {
+      page_capacity *= 2;
+      store->page_first = realloc(store->page_first, page_capacity * sizeof(uint32_t));
+      store->page_lengths = realloc(store->page_lengths,
+                                    page_capacity * sizeof(uint32_t));
+      store->page_offsets = realloc(store->page_offsets,
+                                    (page_capacity + 1) * sizeof(size_t));
+    }
+    uint32_t end = first;
+    while (end < successor_count
+           && (end == first || end - first < PAGE_TARGET_SUCCESSORS)) {
+      /** Extend the page by the whole block starting at end */
+      do {
+        end++;
+      } while (end < successor_count && !starts[end]);
+    }
+    store->page_first[store->page_count] = first;
+    store->page_lengths[store->page_count] = end - first;
+    store->page_offsets[store->page_count] = length;
+    if (end - first > store->max_page_length) { store->max_page_length = end - first; }
+    int64_t previous = 0;
+    for (uint32_t i = first; i < end; ++i) {
+      int64_t delta = (int64_t)successors[i].cumulative - previous;
+      length = write_varint(store->data, length, successors[i].word);
+      length = write_varint(store->data, length,
+                            ((uint64_t)delta << 1) ^ (uint64_t)(delta >> 63));
+      previous = successors[i].cumulative;
+    }
+    store->page_count++;
+    first = end;
+  }
+  free(starts);
+  store->page_offsets[store->page_count] = length;
+  store->data = realloc(store->data, length + 1);
+
+  store->resident = calloc(store->page_count + 1, sizeof(MarkovPageEntry *));
+  for (size_t i = 0; i < PAGE_CACHE_SHARDS; ++i) {
+    pthread_mutex_init(&store->shards[i].lock, NULL);
+  }
+  for (size_t i = 0; i < cache_pages; ++i) {
+    MarkovPageShard *shard = &store->shards[i % PAGE_CACHE_SHARDS];
+    MarkovPageEntry *entry = calloc(1, sizeof(MarkovPageEntry));
+    entry->page = MARKOV_NO_WORD;
+    entry->successors = malloc(store->max_page_length * sizeof(MarkovFrozenSuccessor));
+    entry->next = shard->head;
+    if (shard->head) { shard->head->prev = entry; } else { shard->tail = entry; }
+    shard->head = entry;
+  }
+  return store;
+}
+
+/**
+ * Returns the index of the page holding the successor at the given position.
+*/
+uint32_t markov_page_store_find_page(MarkovPageStore *store, uint32_t first) {
+  size_t low = 0;
+  size_t high = store->page_count - 1;
+  while (low < high) {
+    size_t middle = (low + high + 1) / 2;
+    if (store->page_first[middle] <= first) {
+      low = middle;
+    } else {
+      high = middle - 1;
+    }
+  }
+  return low;
+}
+
+/**
+ * Moves an entry to the head (most recently used end) of its shard's list.
+*/
+void markov_page_shard_touch(MarkovPageShard *shard, MarkovPageEntry *entry) {
+  if (shard->head == entry) { return; }
+  entry->prev->next = entry->next;
+  if (entry->next) {
+    entry->next->prev = entry->prev;
+  } else {
+    shard->tail = entry->prev;
+  }
+  entry->prev = NULL;
+  entry->next = shard->head;
+  shard->head->prev = entry;
+  shard->head = entry;
+}
+
+/**
+ * Returns a pinned cache entry holding the decompressed page with the
+ * successor at position first, decompressing it into the least recently used
+ * unpinned entry of its shard on a miss. If every entry of the shard is pinned
+ * a new entry is added. Sets block to the successors starting at first. The
+ * entry must be released with markov_page_store_release().
+*/
+MarkovPageEntry *markov_page_store_acquire(MarkovPageStore *store, uint32_t first,
+                                           MarkovFrozenSuccessor **block) {
+  double start = get_time_seconds();
+  uint32_t page = markov_page_store_find_page(store, first);
+  MarkovPageShard *shard = &store->shards[page % PAGE_CACHE_SHARDS];
+  pthread_mutex_lock(&shard->lock);
+  MarkovPageEntry *entry = store->resident[page];
+  if (entry) {
+    shard->hits++;
+  } else {
+    shard->misses++;
+    entry = shard->tail;
+    while (entry && entry->pins > 0) {
+      entry = entry->prev;
+    }
+    if (!entry) {
+      entry = calloc(1, sizeof(MarkovPageEntry));
+      entry->successors =
+          malloc(store->max_page_length * sizeof(MarkovFrozenSuccessor));
+      entry->next = shard->head;
+      if (shard->head) { shard->head->prev = entry; } else { shard->tail = entry; }
+      shard->head = entry;
+    } else if (entry->page != MARKOV_NO_WORD) {
+      store->resident[entry->page] = NULL;
+    }
+    const uint8_t *cursor = store->data + store->page_offsets[page];
+    int64_t previous = 0;
+    for (uint32_t i = 0; i < store->page_lengths[page]; ++i) {
+      entry->successors[i].word = read_varint(&cursor);
+      uint64_t zigzag = read_varint(&cursor);
+      previous += (int64_t)(zigzag >> 1) ^ -(int64_t)(zigzag & 1);
+      entry->successors[i].cumulative = previous;
+    }
+    entry->page = page;
+    store->resident[page] = entry;
+  }
+  entry->pins++;
+  markov_page_shard_touch(shard, entry);
+  markov_histogram_record(&shard->latency,
+                          (uint64_t)((get_time_seconds() - start) * 1e9));
+  pthread_mutex_unlock(&shard->lock);
+  *block = &entry->successors[first - store->page_first[page]];
+  return entry;
+}
+
+/**
+ * Unpins a cache entry returned by markov_page_store_acquire().
+*/
+void markov_page_store_release(MarkovPageStore *store, MarkovPageEntry *entry) {
+  MarkovPageShard *shard = &store->shards[entry->page % PAGE_CACHE_SHARDS];
+  pthread_mutex_lock(&shard->lock);
+  entry->pins--;
+  pthread_mutex_unlock(&shard->lock);
+}
+
+/**
+ * Prints the compressed size, the cache hit rate and the lookup latency
+ * percentiles of a MarkovPageStore to stderr.
+*/
+void markov_page_store_report(MarkovPageStore *store, size_t successor_count) {
+  size_t hits = 0;
+  size_t misses = 0;
+  MarkovLatencyHistogram latency = { 0 };
+  for (size_t i = 0; i < PAGE_CACHE_SHARDS; ++i) {
+    pthread_mutex_lock(&store->shards[i].lock);
+    hits += store->shards[i].hits;
+    misses += store->shards[i].misses;
+    markov_histogram_merge(&latency, &store->shards[i].latency);
+    pthread_mutex_unlock(&store->shards[i].lock);
+  }
+  fprintf(stderr, "%zu pages, %zu bytes compressed from %zu, hit rate %.2f%%, "
+          "lookup p50 %llu ns, p99 %llu ns, p99.9 %llu ns\n",
+          store->page_count, store->page_offsets[store->page_count],
+          successor_count * sizeof(MarkovFrozenSuccessor),
+          hits + misses ? 100.0 * hits / (hits + misses) : 0.0,
+          (unsigned long long)markov_histogram_percentile(&latency, 50),
+          (unsigned long long)markov_histogram_percentile(&latency, 99),
+          (unsigned long long)markov_histogram_percentile(&latency, 99.9));
+}
+
+/**
+ * Frees all the data associated with a MarkovPageStore.
+*/
+void markov_page_store_free(MarkovPageStore *store) {
+  if (!store) { return; }
+  for (size_t i = 0; i < PAGE_CACHE_SHARDS; ++i) {
+    MarkovPageEntry *entry = store->shards[i].head;
+    while (entry) {
+      MarkovPageEntry *next = entry->next;
+      free(entry->successors);
+      free(entry);
+      entry = next;
+    }
+    pthread_mutex_destroy(&store->shards[i].lock);
+  }
+  free(store->page_first);
+  free(store->page_lengths);
+  free(store->page_offsets);
+  free(store->data);
+  free(store->resident);
+  free(store);
+}
+
+/**
+ * A read-only, compact version of a MarkovModel used for generation. Contexts
+ * and their successor blocks are stored in flat arrays so that the order of
+ * contexts decides which data shares cache lines and pages. Slots is an open
+ * addressing index from context hashes to positions in the contexts array.
+ * Hits counts how often each context is visited while profiling is set, so
+ * serving threads never write to the model. Classes and oov, when set, are
+ * the word classes and vocabulary cap the model was trained with; they are
+ * owned by the model. Pages, when set, holds the successors compressed and
+ * successors is NULL. Dead_successors counts the successors of blocks
+ * replaced by markov_frozen_refreeze(), and the capacities are the allocated
+ * lengths of the arrays it appends to, or 0 when they are exactly full.
+ * Image, when set, is the mapping of a saved model that contexts, successors
+ * and slots point into. Shared_vocab is set when the vocabulary is owned
+ * elsewhere.
+*/
+typedef struct MarkovFrozen {
+  MarkovVocab *vocab;
+  MarkovClasses *classes;
+  MarkovOov *oov;
+  size_t context_count;
+  size_t context_capacity;
+  MarkovFrozenContext *contexts;
+  size_t *hits;
+  bool profiling;
+  size_t successor_count;
+  size_t successor_capacity;
+  size_t dead_successors;
+  MarkovFrozenSuccessor *successors;
+  MarkovPageStore *pages;
+  size_t slot_count;
+  uint32_t *slots;
+  void *image;
+  size_t image_size;
+  bool shared_vocab;
+} MarkovFrozen;
+
+/**
+ * Return the hash for an array of MARKOV_CONTEXT_SIZE word ids. The hash is
+ * calculated using the djb2 algorithm over the ids, then mixed so that the low
+ * bits used by the slots index depend on every id; ids are small and dense, so
+ * plain djb2 values cluster and make linear probing quadratic on large models.
+*/
+size_t markov_frozen_get_hash(const uint32_t *words) {
+  uint64_t hash = 5381;
+  for (size_t i = 0; i < MARKOV_CONTEXT_SIZE; ++i) {
+    hash = ((hash << 5) + hash) + words[i];
+  }
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdULL;
+  hash ^= hash >> 33;
+  return hash;
+}
+
+/**
+ * Rebuilds the slots index of a MarkovFrozen model from its contexts array.
+ * Must be called whenever the contexts array is reordered.
+*/
+void markov_frozen_build_index(MarkovFrozen *frozen) {
+  free(frozen->slots);
+  frozen->slot_count = 16;
+  while (frozen->slot_count < frozen->context_count * 2) {
+    frozen->slot_count *= 2;
+  }
+  frozen->slots = malloc(frozen->slot_count * sizeof(uint32_t));
+  memset(frozen->slots, 0xff, frozen->slot_count * sizeof(uint32_t));
+  size_t mask = frozen->slot_count - 1;
+  for (uint32_t i = 0; i < frozen->context_count; ++i) {
+    size_t slot = markov_frozen_get_hash(frozen->contexts[i].words) & mask;
+    while (frozen->slots[slot] != MARKOV_NO_WORD) {
+      slot = (slot + 1) & mask;
+    }
+    frozen->slots[slot] = i;
+  }
+}
+
+/**
+ * Returns the position of a context in the contexts array of a MarkovFrozen
+ * model, or MARKOV_NO_WORD if the context is unknown.
+*/
+uint32_t markov_frozen_find(MarkovFrozen *frozen, const uint32_t *words) {
+  size_t mask = frozen->slot_count - 1;
+  size_t slot = markov_frozen_get_hash(words) & mask;
+  while (frozen->slots[slot] != MARKOV_NO_WORD) {
+    uint32_t index = frozen->slots[slot];
+    MarkovFrozenContext *context = &frozen->contexts[index];
+    if (memcmp(context->words, words, sizeof(context->words)) == 0) {
+      return index;
+    }
+    slot = (slot + 1) & mask;
+  }
+  return MARKOV_NO_WORD;
+}
+
+/**
+ * Returns the id of a word of a MarkovModel in a MarkovFrozen model being
+ * compiled, or MARKOV_NO_WORD for a NULL word. Without ids the word is
+ * interned in vocab; with ids it is looked up in vocab, which already holds
+ * it, and mapped through ids.
+*/
+uint32_t markov_freeze_word_id(MarkovVocab *vocab, const uint32_t *ids,
+                               const char *word) {
+  if (!word) { return MARKOV_NO_WORD; }
+  if (!ids) { return markov_vocab_intern(vocab, word); }
+  return ids[markov_vocab_find(vocab, word)];
+}
+
+/**
+ * Compiles a node of a MarkovModel into a frozen context whose successor block
+ * starts at first, sorting the successors by descending count and turning the
+ * counts into running totals. Words are mapped with markov_freeze_word_id().
+*/
+void markov_freeze_node(MarkovNode *node, MarkovVocab *vocab, const uint32_t *ids,
+                        MarkovFrozenContext *context, MarkovFrozenSuccessor *successors,
+                        size_t first) {
+  MarkovFrozenSuccessor *successor = successors + first;
+  for (size_t i = 0; i < MARKOV_CONTEXT_SIZE; ++i) {
+    context->words[i] = markov_freeze_word_id(vocab, ids,
+                                              node->context->previous_words[i]);
+  }
+  context->first = first;
+  context->length = 0;
+  for (MarkovValue *value = node->value; value; value = value->next) {
+    /** Insertion sort by descending count; blocks are short. */
+    MarkovFrozenSuccessor entry = {
+      markov_freeze_word_id(vocab, ids, value->word), value->count
+    };
+    size_t j = context->length++;
+    while (j > 0 && successor[j - 1].cumulative < entry.cumulative) {
+      successor[j] = successor[j - 1];
+      j--;
+    }
+    successor[j] = entry;
+  }
+  uint32_t total = 0;
+  for (size_t j = 0; j < context->length; ++j) {
+    total += successor[j].cumulative;
+    successor[j].cumulative = total;
+  }
+  context->total = total;
+}
+
+/**
+ * A thread of a parallel freeze, compiling the buckets [first_bucket,
+ * last_bucket) of a MarkovModel. The count pass sets context_count and
+ * successor_count and interns the words of the buckets in a local vocab, in
+ * the order a sequential freeze would. The scatter pass writes the contexts
+ * and successors at the offsets given by the prefix sums over earlier threads,
+ * with ids mapping local word ids to ids of the frozen vocabulary.
+*/
+typedef struct MarkovFreezeTask {
+  MarkovModel *model;
+  MarkovFrozen *frozen;
+  size_t first_bucket;
+  size_t last_bucket;
+  size_t context_count;
+  size_t successor_count;
+  size_t context_offset;
+  size_t successor_offset;
+  MarkovVocab *vocab;
+  uint32_t *ids;
+  pthread_t thread;
+} MarkovFreezeTask;
+
+/**
+ * The count pass of a MarkovFreezeTask.
+*/
+void *markov_freeze_count(void *state) {
+  MarkovFreezeTask *task = state;
+  for (size_t i = task->first_bucket; i < task->last_bucket; ++i) {
+    for (MarkovNode *node = task->model->nodes[i]; node; node = node->next) {
+      task->context_count++;
+      for (size_t j = 0; j < MARKOV_CONTEXT_SIZE; ++j) {
+        markov_freeze_word_id(task->vocab, NULL, node->context->previous_words[j]);
+      }
+      for (MarkovValue *value = node->value; value; value = value->next) {
+        markov_vocab_intern(task->vocab, value->word);
+        task->successor_count++;
+      }
+    }
+  }
+  return NULL;
+}
+
+/**
+ * The scatter pass of a MarkovFreezeTask.
+*/
+void *markov_freeze_scatter(void *state) {
+  MarkovFreezeTask *task = state;
+  MarkovFrozen *frozen = task->frozen;
+  size_t context = task->context_offset;
+  size_t first = task->successor_offset;
+  for (size_t i = task->first_bucket; i < task->last_bucket; ++i) {
+    for (MarkovNode *node = task->model->nodes[i]; node; node = node->next) {
+      markov_freeze_node(node, task->vocab, task->ids, &frozen->contexts[context],
+                         frozen->successors, first);
+      first += frozen->contexts[context++].length;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Compiles a MarkovModel into a MarkovFrozen model on thread_count threads,
+ * producing the same model as markov_model_freeze(). The buckets are split
+ * into contiguous ranges; a first pass counts the contexts and successors of
+ * each range, an exclusive prefix sum over the ranges gives each range its
+ * offsets in the final arrays, and a second pass compiles every range in
+ * place. The local vocabularies are merged in range order between the passes.
+ * The caller is responsible for freeing the returned model.
+*/
+MarkovFrozen *markov_model_freeze_parallel(MarkovModel *model, size_t thread_count) {
+  if (!model) { return NULL; }
+  MarkovFrozen *frozen = calloc(1, sizeof(MarkovFrozen));
+  frozen->vocab = markov_vocab_new();
+  MarkovFreezeTask *tasks = calloc(thread_count, sizeof(MarkovFreezeTask));
+  for (size_t t = 0; t < thread_count; ++t) {
+    tasks[t].model = model;
+    tasks[t].frozen = frozen;
+    tasks[t].first_bucket = model->size * t / thread_count;
+    tasks[t].last_bucket = model->size * (t + 1) / thread_count;
+    tasks[t].vocab = markov_vocab_new();
+    pthread_create(&tasks[t].thread, NULL, markov_freeze_count, &tasks[t]);
+  }
+  for (size_t t = 0; t < thread_count; ++t) {
+    pthread_join(tasks[t].thread, NULL);
+    tasks[t].context_offset = frozen->context_count;
+    tasks[t].successor_offset = frozen->successor_count;
+    frozen->context_count += tasks[t].context_count;
+    frozen->successor_count += tasks[t].successor_count;
+    tasks[t].ids = malloc(tasks[t].vocab->size * sizeof(uint32_t));
+    for (uint32_t id = 0; id < tasks[t].vocab->size; ++id) {
+      tasks[t].ids[id] = markov_vocab_intern(frozen->vocab, tasks[t].vocab->words[id]);
+    }
+  }
+  frozen->contexts = malloc(frozen->context_count * sizeof(MarkovFrozenContext));
+  frozen->hits = calloc(frozen->context_count, sizeof(size_t));
+  frozen->successors = malloc(frozen->successor_count * sizeof(MarkovFrozenSuccessor));
+  for (size_t t = 0; t < thread_count; ++t) {
+    pthread_create(&tasks[t].thread, NULL, markov_freeze_scatter, &tasks[t]);
+  }
+  for (size_t t = 0; t < thread_count; ++t) {
+    pthread_join(tasks[t].thread, NULL);
+    markov_vocab_free(tasks[t].vocab);
+    free(tasks[t].ids);
+  }
+  free(tasks);
+  markov_frozen_build_index(frozen);
+  return frozen;
+}
+
+/**
+ * Compiles a MarkovModel into a MarkovFrozen model. Contexts are laid out in
+ * the order of the model's buckets and the successors of each context are
+ * sorted by descending count. With FREEZE_THREAD_COUNT above 1 the model is
+ * compiled by markov_model_freeze_parallel(). The MarkovFrozen model does not
+ * reference the MarkovModel, which may be freed afterwards. The caller is
+ * responsible for freeing the returned model.
+*/
+MarkovFrozen *markov_model_freeze(MarkovModel *model) {
+  if (!model) { return NULL; }
+  if (FREEZE_THREAD_COUNT > 1) {
+    return markov_model_freeze_parallel(model, FREEZE_THREAD_COUNT);
+  }
+  MarkovFrozen *frozen = calloc(1, sizeof(MarkovFrozen));
+  frozen->vocab = markov_vocab_new();
+  for (size_t i = 0; i < model->size; ++i) {
+    for (MarkovNode *node = model->nodes[i]; node; node = node->next) {
+      frozen->context_count++;
+      for (MarkovValue *value = node->value; value; value = value->next) {
+        frozen->successor_count++;
+      }
+    }
+  }
+  frozen->contexts = malloc(frozen->context_count * sizeof(MarkovFrozenContext));
+  frozen->hits = calloc(frozen->context_count, sizeof(size_t));
+  frozen->successors = malloc(frozen->successor_count * sizeof(MarkovFrozenSuccessor));
+
+  size_t first = 0;
+  MarkovFrozenContext *context = frozen->contexts;
+  for (size_t i = 0; i < model->size; ++i) {
+    for (MarkovNode *node = model->nodes[i]; node; node = node->next) {
+      markov_freeze_node(node, frozen->vocab, NULL, context, frozen->successors, first);
+      first += context->length;
+      context++;
+    }
+  }
+  markov_frozen_build_index(frozen);
+  return frozen;
+}
+
+/**
+ * Moves the successor blocks of a MarkovFrozen model back to back in the
+ * order of its contexts, dropping the blocks replaced by
+ * markov_frozen_refreeze().
+*/
+void markov_frozen_compact(MarkovFrozen *frozen) {
+  size_t live = frozen->successor_count - frozen->dead_successors;
+  MarkovFrozenSuccessor *successors = malloc(live * sizeof(MarkovFrozenSuccessor));
+  uint32_t first = 0;
+  for (size_t i = 0; i < frozen->context_count; ++i) {
+    MarkovFrozenContext *context = &frozen->contexts[i];
+    memcpy(&successors[first], &frozen->successors[context->first],
+           context->length * sizeof(MarkovFrozenSuccessor));
+    context->first = first;
+    first += context->length;
+  }
+  free(frozen->successors);
+  frozen->successors = successors;
+  frozen->successor_count = live;
+  frozen->successor_capacity = live;
+  frozen->dead_successors = 0;
+}
+
+/**
+ * Returns the number of nodes in the dirty list of model that cannot be found
+ * in a MarkovFrozen model, or whose context there does not have the total
+ * count of the node. Used to check markov_frozen_refreeze().
+*/
+size_t markov_frozen_check_patch(MarkovFrozen *frozen, MarkovModel *model) {
+  size_t wrong = 0;
+  for (size_t i = 0; i < model->dirty_count; ++i) {
+    MarkovNode *node = model->dirty[i];
+    uint32_t words[MARKOV_CONTEXT_SIZE];
+    for (size_t j = 0; j < MARKOV_CONTEXT_SIZE; ++j) {
+      words[j] = markov_freeze_word_id(frozen->vocab, NULL,
+                                       node->context->previous_words[j]);
+    }
+    uint32_t total = 0;
+    for (MarkovValue *value = node->value; value; value = value->next) {
+      total += value->count;
+    }
+    uint32_t index = markov_frozen_find(frozen, words);
+    if (index == MARKOV_NO_WORD || frozen->contexts[index].total != total) {
+      wrong++;
+    }
+  }
+  return wrong;
+}
+
+/**
+ * Patches a MarkovFrozen model compiled from model with the nodes in the
+ * dirty list of model, then empties the list. The block of each dirty context
+ * is rebuilt at the end of the successor array, in the overflow region, and
+ * new contexts are appended to the contexts array and the index, so the cost
+ * is proportional to the changed contexts rather than to the model. Once
+ * replaced blocks take more than REFREEZE_COMPACT_RATIO of the successor
+ * array, the model is compacted. With BENCHMARK_QUOTE_COUNT set, every dirty
+ * context is looked up again to check the patch. Returns false, leaving the
+ * dirty list untouched, if the successors are compressed.
+*/
+bool markov_frozen_refreeze(MarkovFrozen *frozen, MarkovModel *model) {
+  if (frozen->pages) { return false; }
+  for (size_t i = 0; i < model->dirty_count; ++i) {
+    MarkovNode *node = model->dirty[i];
+    uint32_t words[MARKOV_CONTEXT_SIZE];
+    for (size_t j = 0; j < MARKOV_CONTEXT_SIZE; ++j) {
+      words[j] = markov_freeze_word_id(frozen->vocab, NULL,
+                                       node->context->previous_words[j]);
+    }
+    uint32_t index = markov_frozen_find(frozen, words);
+    if (index == MARKOV_NO_WORD) {
+      if (frozen->context_count >= frozen->context_capacity) {
+        frozen->context_capacity = frozen->context_count * 2 + 16;
+        size_t capacity = frozen->context_capacity;
+        frozen->contexts = realloc(frozen->contexts,
+                                   capacity * sizeof(MarkovFrozenContext));
+        frozen->hits = realloc(frozen->hits, capacity * sizeof(size_t));
+      }
+      index = frozen->context_count++;
+      frozen->hits[index] = 0;
+      frozen->contexts[index].length = 0;
+      /** The index hashes the words, so they must be set before it is updated */
+      memcpy(frozen->contexts[index].words, words, sizeof(words));
+      if (frozen->context_count * 2 > frozen->slot_count) {
+        markov_frozen_build_index(frozen);
+      } else {
+        size_t mask = frozen->slot_count - 1;
+        size_t slot = markov_frozen_get_hash(words) & mask;
+        while (frozen->slots[slot] != MARKOV_NO_WORD) {
+          slot = (slot + 1) & mask;
+        }
+        frozen->slots[slot] = index;
+      }
+    }
+    size_t length = 0;
+    for (MarkovValue *value = node->value; value; value = value->next) {
+      length++;
+    }
+    if (frozen->successor_count + length > frozen->successor_capacity) {
+      frozen->successor_capacity = (frozen->successor_count + length) * 2;
+      frozen->successors = realloc(frozen->successors,
+                                   frozen->successor_capacity
+                                   * sizeof(MarkovFrozenSuccessor));
+    }
+    frozen->dead_successors += frozen->contexts[index].length;
+    markov_freeze_node(node, frozen->vocab, NULL, &frozen->contexts[index],
+                       frozen->successors, frozen->successor_count);
+    frozen->successor_count += length;
+  }
+  if (BENCHMARK_QUOTE_COUNT) {
+    size_t wrong = markov_frozen_check_patch(frozen, model);
+    fprintf(stderr, "patch check: %zu of %zu dirty contexts missing or wrong\n", wrong,
+            model->dirty_count);
+  }
+  markov_model_clear_dirty(model);
+  if (frozen->dead_successors > frozen->successor_count * REFREEZE_COMPACT_RATIO) {
+    markov_frozen_compact(frozen);
+  }
+  return true;
+}
+
+/**
+ * A set of word ids stored as a bitset, used to exclude words from generation.
+ * Allowed_first maps each context of the model the mask was built for to the
+ * start of its allowed counts in allowed, or to MARKOV_NO_WORD if its block
+ * holds no masked successor. The allowed counts run like the cumulative
+ * counts of the block, except that masked successors add nothing to them.
+*/
+typedef struct MarkovMask {
+  size_t size;
+  uint64_t *bits;
+  size_t context_count;
+  uint32_t *allowed_first;
+  uint32_t *allowed;
+} MarkovMask;
+
+/**
+ * Returns a new, empty MarkovMask covering ids below size. The caller is
+ * responsible for freeing it with markov_mask_free().
+*/
+MarkovMask *markov_mask_new(size_t size) {
+  MarkovMask *mask = calloc(1, sizeof(MarkovMask));
+  mask->size = size;
+  mask->bits = calloc((size + 63) / 64, sizeof(uint64_t));
+  return mask;
+}
+
+/**
+ * Adds an id to a MarkovMask.
+*/
+void markov_mask_set(MarkovMask *mask, uint32_t id) {
+  mask->bits[id / 64] |= (uint64_t)1 << (id % 64);
+}
+
+/**
+ * Returns true if an id is part of a MarkovMask. A NULL mask is empty.
+*/
+bool markov_mask_test(const MarkovMask *mask, uint32_t id) {
+  if (!mask || id >= mask->size) { return false; }
+  return (mask->bits[id / 64] >> (id % 64)) & 1;
+}
+
+/**
+ * Returns the allowed counts of a context of the model a MarkovMask was built
+ * for, or NULL if the mask leaves the block of the context untouched.
+*/
+const uint32_t *markov_mask_get_allowed(const MarkovMask *mask, uint32_t index) {
+  if (!mask || !mask->allowed_first || index >= mask->context_count) { return NULL; }
+  uint32_t first = mask->allowed_first[index];
+  return first == MARKOV_NO_WORD ? NULL : &mask->allowed[first];
+}
+
+/**
+ * Frees all the data associated with a MarkovMask.
+*/
+void markov_mask_free(MarkovMask *mask) {
+  if (!mask) { return; }
+  free(mask->bits);
+  free(mask->allowed_first);
+  free(mask->allowed);
+  free(mask);
+}
+
+/**
+ * Returns true if a word from a vocabulary matches a banned word, either
+ * exactly or once trailing punctuation is ignored ("evil." matches "evil").
+*/
+bool check_banned_word(const char *word, const char *banned, size_t banned_length) {
+  if (strncmp(word, banned, banned_length) != 0) { return false; }
+  for (word += banned_length; *word; ++word) {
+    if (!strchr(".,;:!?\"')", *word)) { return false; }
+  }
+  return true;
+}
+
+/**
+ * Removes the words that match a banned word from a MarkovValue list and
+ * returns the new head of the list.
+*/
+MarkovValue *markov_value_remove_banned(MarkovValue *value, const char *banned,
+                                        size_t banned_length) {
+  MarkovValue **link = &value;
+  while (*link) {
+    MarkovValue *current = *link;
+    if (check_banned_word(markov_oov_unescape(current->word), banned, banned_length)) {
+      *link = current->next;
+      current->next = NULL;
+      markov_value_free(current);
+    } else {
+      link = &current->next;
+    }
+  }
+  return value;
+}
+
+/**
+ * Removes the words that match a banned word from the side table of a
+ * MarkovOov, so they never stand in for OOV_WORD.
+*/
+void markov_oov_remove_banned(MarkovOov *oov, const char *banned,
+                              size_t banned_length) {
+  size_t kept = 0;
+  for (size_t i = 0; i < oov->rare_count; ++i) {
+    if (check_banned_word(oov->rare_words[i], banned, banned_length)) {
+      free(oov->rare_words[i]);
+    } else {
+      oov->rare_words[kept++] = oov->rare_words[i];
+    }
+  }
+  oov->rare_count = kept;
+}
+
+/**
+ * Sets block to the successors of a context of a MarkovFrozen model. When the
+ * successors are compressed the block lives in a pinned page cache entry,
+ * which is returned and must be passed to markov_frozen_release_block();
+ * otherwise returns NULL.
+*/
+MarkovPageEntry *markov_frozen_acquire_block(MarkovFrozen *frozen,
+                                             MarkovFrozenContext *context,
+                                             MarkovFrozenSuccessor **block) {
+  if (!frozen->pages) {
+    *block = &frozen->successors[context->first];
+    return NULL;
+  }
+  return markov_page_store_acquire(frozen->pages, context->first, block);
+}
+
+/**
+ * Releases a block returned by markov_frozen_acquire_block().
+*/
+void markov_frozen_release_block(MarkovFrozen *frozen, MarkovPageEntry *entry) {
+  if (!entry) { return; }
+  markov_page_store_release(frozen->pages, entry);
+}
+
+/**
+ * Fills in the allowed counts of a MarkovMask for the contexts of a
+ * MarkovFrozen model whose blocks hold a masked successor, so sampling under
+ * the mask stays a single binary search. An empty mask needs none.
+*/
+void markov_mask_count_allowed(MarkovMask *mask, MarkovFrozen *frozen) {
+  bool empty = true;
+  for (size_t i = 0; i < (mask->size + 63) / 64 && empty; ++i) {
+    empty = mask->bits[i] == 0;
+  }
+  if (empty) { return; }
+  mask->context_count = frozen->context_count;
+  mask->allowed_first = malloc(frozen->context_count * sizeof(uint32_t));
+  size_t count = 0;
+  size_t capacity = 0;
+  for (size_t i = 0; i < frozen->context_count; ++i) {
+    MarkovFrozenContext *context = &frozen->contexts[i];
+    MarkovFrozenSuccessor *block;
+    MarkovPageEntry *entry = markov_frozen_acquire_block(frozen, context, &block);
+    bool masked = false;
+    for (size_t j = 0; j < context->length && !masked; ++j) {
+      masked = markov_mask_test(mask, block[j].word);
+    }
+    mask->allowed_first[i] = masked ? count : MARKOV_NO_WORD;
+    if (masked && count + context->length > capacity) {
+      capacity = (count + context->length) * 2;
+      mask->allowed = realloc(mask->allowed, capacity * sizeof(uint32_t));
+    }
+    uint32_t allowed = 0;
+    for (size_t j = 0; j < context->length && masked; ++j) {
+      if (!markov_mask_test(mask, block[j].word)) {
+        allowed += block[j].cumulative - (j > 0 ? block[j - 1].cumulative : 0);
+      }
+      mask->allowed[count++] = allowed;
+    }
+    markov_frozen_release_block(frozen, entry);
+  }
+}
+
+/**
+ * Returns a MarkovMask of the ids of a MarkovFrozen model that match any of
+ * the space separated banned words. Banned words are also removed from the
+ * side table of the vocabulary cap and from the emissions of word classes,
+ * which generation samples without the mask, and class labels left without
+ * words are masked. The mask holds allowed counts for the contexts of the
+ * model as it is now, so it is rebuilt when the model changes. The caller is
+ * responsible for freeing the mask.
+*/
+MarkovMask *markov_frozen_mask_words(MarkovFrozen *frozen, const char *banned_words) {
+  MarkovMask *mask = markov_mask_new(frozen->vocab->size);
+  char *banned = strdup(banned_words);
+  char *save;
+  for (char *word = strtok_r(banned, " ", &save); word;
+       word = strtok_r(NULL, " ", &save)) {
+    size_t length = strlen(word);
+    if (frozen->oov) {
+      markov_oov_remove_banned(frozen->oov, word, length);
+    }
+    if (frozen->classes) {
+      for (size_t i = 0; i < frozen->classes->class_count; ++i) {
+        MarkovValue **emission = &frozen->classes->emissions[i];
+        *emission = markov_value_remove_banned(*emission, word, length);
+      }
+      continue;
+    }
+    for (uint32_t id = 0; id < frozen->vocab->size; ++id) {
+      char *unescaped = markov_oov_unescape(frozen->vocab->words[id]);
+      if (check_banned_word(unescaped, word, length)) {
+        markov_mask_set(mask, id);
+      }
+    }
+  }
+  free(banned);
+  if (frozen->classes) {
+    for (size_t i = 0; i < frozen->classes->class_count; ++i) {
+      uint32_t id = markov_vocab_find(frozen->vocab, frozen->classes->labels[i]);
+      if (!frozen->classes->emissions[i] && id != MARKOV_NO_WORD) {
+        markov_mask_set(mask, id);
+      }
+    }
+  }
+  markov_mask_count_allowed(mask, frozen);
+  return mask;
+}
+
+/**
+ * Samples a successor from the block of a context, or returns MARKOV_NO_WORD
+ * if every successor is masked. Allowed holds the allowed counts of the
+ * context from markov_mask_get_allowed(), or NULL to draw from the whole
+ * block. Masked successors add nothing to the allowed counts, so the binary
+ * search never stops on one and the others are renormalized for free.
+*/
+uint32_t markov_frozen_sample_block(MarkovFrozenContext *context,
+                                    MarkovFrozenSuccessor *block,
+                                    const uint32_t *allowed) {
+  uint32_t total = allowed ? allowed[context->length - 1] : context->total;
+  if (total == 0) { return MARKOV_NO_WORD; }
+  uint32_t r = markov_random_next() % total;
+  size_t low = 0;
+  size_t high = context->length - 1;
+  while (low < high) {
+    size_t middle = (low + high) / 2;
+    uint32_t cumulative = allowed ? allowed[middle] : block[middle].cumulative;
+    if (cumulative > r) {
+      high = middle;
+    } else {
+      low = middle + 1;
+    }
+  }
+  return block[low].word;
+}
+
+/**
+ * When given a context of word ids, returns the id of a possible next word
+ * based upon the data in a MarkovFrozen model, or MARKOV_NO_WORD if the
+ * context is unknown or every successor is masked. Records a hit for the
+ * context while profiling.
+*/
+uint32_t markov_frozen_get_next(MarkovFrozen *frozen, const uint32_t *words,
+                                const MarkovMask *mask) {
+  uint32_t index = markov_frozen_find(frozen, words);
+  if (index == MARKOV_NO_WORD) { return MARKOV_NO_WORD; }
+  if (frozen->profiling) {
+    frozen->hits[index]++;
+  }
+  MarkovFrozenContext *context = &frozen->contexts[index];
+  MarkovFrozenSuccessor *block;
+  MarkovPageEntry *entry = markov_frozen_acquire_block(frozen, context, &block);
+  const uint32_t *allowed = markov_mask_get_allowed(mask, index);
+  uint32_t word = markov_frozen_sample_block(context, block, allowed);
+  markov_frozen_release_block(frozen, entry);
+  return word;
+}
+
+/**
+ * An alias table over the successors of one context, for drawing many samples
+ * in constant time each: pick a column uniformly, then keep its word if a
+ * uniform 32-bit number is below the column's threshold, else take its alias.
+*/
+typedef struct MarkovAliasTable {
+  uint32_t count;
+  uint32_t *thresholds;
+  uint32_t *words;
+  uint32_t *aliases;
+} MarkovAliasTable;
+
+/**
+ * Builds the MarkovAliasTable of a successor block with Vose's method. The
+ * caller is responsible for freeing it with markov_alias_table_free().
+*/
+MarkovAliasTable *markov_alias_table_new(const MarkovFrozenSuccessor *block,
+                                         uint32_t length) {
+  MarkovAliasTable *table = malloc(sizeof(MarkovAliasTable));
+  table->count = length;
+  table->thresholds = malloc(length * sizeof(uint32_t));
+  table->words = malloc(length * sizeof(uint32_t));
+  table->aliases = malloc(length * sizeof(uint32_t));
+  double *scaled = malloc(length * sizeof(double));
+  uint32_t *small = malloc(length * sizeof(uint32_t));
+  uint32_t *large = malloc(length * sizeof(uint32_t));
+  size_t small_count = 0;
+  size_t large_count = 0;
+  uint32_t total = block[length - 1].cumulative;
+  for (uint32_t i = 0; i < length; ++i) {
+    uint32_t count = block[i].cumulative - (i > 0 ? block[i - 1].cumulative : 0);
+    scaled[i] = (double)count * length / total;
+    table->words[i] = block[i].word;
+    table->aliases[i] = block[i].word;
+    if (scaled[i] < 1.0) {
+      small[small_count++] = i;
+    } else {
+      large[large_count++] = i;
+    }
+  }
+  while (small_count > 0 && large_count > 0) {
+    uint32_t column = small[--small_count];
+    uint32_t donor = large[large_count - 1];
+    table->thresholds[column] = (uint32_t)(scaled[column] * 4294967296.0);
+    table->aliases[column] = block[donor].word;
+    scaled[donor] -= 1.0 - scaled[column];
+    if (scaled[donor] < 1.0) {
+      large_count--;
+      small[small_count++] = donor;
+    }
+  }
+  /** Whatever is left is full up to rounding error */
+  while (large_count > 0) {
+    table->thresholds[large[--large_count]] = UINT32_MAX;
+  }
+  while (small_count > 0) {
+    table->thresholds[small[--small_count]] = UINT32_MAX;
+  }
+  free(scaled);
+  free(small);
+  free(large);
+  return table;
+}
+
+/**
+ * Frees all the data associated with a MarkovAliasTable.
+*/
+void markov_alias_table_free(MarkovAliasTable *table) {
+  if (!table) { return; }
+  free(table->thresholds);
+  free(table->words);
+  free(table->aliases);
+  free(table);
+}
+
+/**
+ * Fills out with count samples from an alias table, drawing
+ * MARKOV_RANDOM_LANES samples at a time from streams. The column is taken
+ * from the high half of each random number with a multiply and shift, and the
+ * coin from the low half, so the inner loop has no division and no branch.
+*/
+void markov_alias_table_sample(const MarkovAliasTable *table,
+                               MarkovRandomStreams *streams, uint32_t *out,
+                               size_t count) {
+  uint64_t random[MARKOV_RANDOM_LANES];
+  uint32_t batch[MARKOV_RANDOM_LANES];
+  for (size_t i = 0; i < count; i += MARKOV_RANDOM_LANES) {
+    markov_random_streams_next(streams, random);
+    for (size_t lane = 0; lane < MARKOV_RANDOM_LANES; ++lane) {
+      uint32_t column = (uint32_t)(((random[lane] >> 32) * table->count) >> 32);
+      bool keep = (uint32_t)random[lane] < table->thresholds[column];
+      batch[lane] = keep ? table->words[column] : table->aliases[column];
+    }
+    size_t length = count - i < MARKOV_RANDOM_LANES ? count - i : MARKOV_RANDOM_LANES;
+    memcpy(out + i, batch, length * sizeof(uint32_t));
+  }
+}
+
+/**
+ * Fills out with count samples of the next word after a context of word ids
+ * of a MarkovFrozen model, drawn from streams, for evaluation jobs that need
+ * many draws from one context. Builds an alias table once, so the cost per
+ * sample does not depend on the number of successors. Returns false, leaving
+ * out untouched, if the context is unknown.
+*/
+bool markov_frozen_sample_many(MarkovFrozen *frozen, const uint32_t *words,
+                               MarkovRandomStreams *streams, uint32_t *out,
+                               size_t count) {
+  uint32_t index = markov_frozen_find(frozen, words);
+  if (index == MARKOV_NO_WORD) { return false; }
+  MarkovFrozenContext *context = &frozen->contexts[index];
+  MarkovFrozenSuccessor *block;
+  MarkovPageEntry *entry = markov_frozen_acquire_block(frozen, context, &block);
+  MarkovAliasTable *table = markov_alias_table_new(block, context->length);
+  markov_frozen_release_block(frozen, entry);
+  markov_alias_table_sample(table, streams, out, count);
+  markov_alias_table_free(table);
+  return true;
+}
+
+/**
+ * Draws sample_count samples from the context with the most successors of a
+ * MarkovFrozen model, one at a time with markov_random_next() and in bulk
+ * with markov_frozen_sample_many(), and prints both rates to stderr.
+*/
+void markov_frozen_report_sampling(MarkovFrozen *frozen, size_t sample_count) {
+  if (frozen->context_count == 0) { return; }
+  uint32_t widest = 0;
+  for (uint32_t i = 1; i < frozen->context_count; ++i) {
+    if (frozen->contexts[i].length > frozen->contexts[widest].length) { widest = i; }
+  }
+  MarkovFrozenContext *context = &frozen->contexts[widest];
+  uint32_t *out = malloc(sample_count * sizeof(uint32_t));
+  MarkovFrozenSuccessor *block;
+  double start = get_time_seconds();
+  MarkovPageEntry *entry = markov_frozen_acquire_block(frozen, context, &block);
+  for (size_t i = 0; i < sample_count; ++i) {
+    out[i] = markov_frozen_sample_block(context, block, NULL);
+  }
+  markov_frozen_release_block(frozen, entry);
+  double single = get_time_seconds() - start;
+
+  MarkovRandomStreams streams;
+  markov_random_streams_seed(&streams, time(NULL));
+  start = get_time_seconds();
+  markov_frozen_sample_many(frozen, context->words, &streams, out, sample_count);
+  double bulk = get_time_seconds() - start;
+  fprintf(stderr, "sampling %u successors: %.1f M/s one at a time, %.1f M/s in bulk\n",
+          context->length, sample_count / single / 1e6, sample_count / bulk / 1e6);
+  free(out);
+}
+
+/**
+ * Returns the word to output for a word id sampled from a MarkovFrozen model.
+ * Class labels are resolved by sampling a word of the class, OOV_WORD is
+ * replaced by a word from the side table of the vocabulary cap, and escaped
+ * corpus words lose their escape.
+*/
+char *markov_frozen_emit_word(MarkovFrozen *frozen, uint32_t id) {
+  char *word = frozen->vocab->words[id];
+  if (frozen->classes) {
+    size_t label = markov_classes_parse_label(word);
+    word = markov_value_get_random(frozen->classes->emissions[label]);
+  }
+  if (frozen->oov && strcmp(word, OOV_WORD) == 0) {
+    word = markov_oov_sample(frozen->oov);
+  } else if (frozen->oov) {
+    word = markov_oov_unescape(word);
+  }
+  return word;
+}
+
+/**
+ * A generated quote represented as references to the words stored in the
+ * model it was generated from. The words are not copied, so a MarkovQuote is
+ * only valid as long as that model.
+*/
+typedef struct MarkovQuote {
+  size_t length;
+  char *words[MAX_QUOTE_LENGTH + 1];
+} MarkovQuote;
+
+/**
+ * A function called with each word of a quote as soon as it is sampled: its
+ * id in the vocabulary of the model and the word to output, which stays valid
+ * as long as the model. Return false to stop the quote.
+*/
+typedef bool (*MarkovTokenHandler)(void *state, uint32_t id, const char *word,
+                                   size_t length);
+
+/**
+ * Generates a quote from the given MarkovFrozen model word by word, calling
+ * handler with each word before the next is sampled and never sampling a word
+ * in mask (which may be NULL). The quote stops early when handler returns
+ * false or cancel (which may be NULL) is set, for example by another thread.
+ * Returns the number of words passed to handler.
+*/
+size_t markov_frozen_stream_words(MarkovFrozen *frozen, const MarkovMask *mask,
+                                  const atomic_bool *cancel, MarkovTokenHandler handler,
+                                  void *state) {
+  uint32_t words[MARKOV_CONTEXT_SIZE];
+  for (size_t i = 0; i < MARKOV_CONTEXT_SIZE; ++i) {
+    words[i] = MARKOV_NO_WORD;
+  }
+  size_t length = 0;
+  while (length <= MAX_QUOTE_LENGTH
+         && !(cancel && atomic_load_explicit(cancel, memory_order_relaxed))) {
+    uint32_t id = markov_frozen_get_next(frozen, words, mask);
+    if (id == MARKOV_NO_WORD) { break; }
+    memmove(words, words + 1, (MARKOV_CONTEXT_SIZE - 1) * sizeof(uint32_t));
+    words[MARKOV_CONTEXT_SIZE - 1] = id;
+    char *word = markov_frozen_emit_word(frozen, id);
+    length++;
+    if (!handler(state, id, word, strlen(word)) || check_end_condition(word)) { break; }
+  }
+  return length;
+}
+
+/**
+ * A MarkovTokenHandler that appends each word to a MarkovQuote.
+*/
+bool markov_quote_add_token(void *state, uint32_t id, const char *word, size_t length) {
+  (void)id;
+  (void)length;
+  MarkovQuote *quote = state;
+  quote->words[quote->length++] = (char *)word;
+  return true;
+}
+
+/**
+ * Generates a quote from the given MarkovFrozen model into a MarkovQuote,
+ * never sampling a word in mask (which may be NULL).
+*/
+void markov_frozen_generate_words(MarkovFrozen *frozen, const MarkovMask *mask,
+                                  MarkovQuote *quote) {
+  quote->length = 0;
+  markov_frozen_stream_words(frozen, mask, NULL, markov_quote_add_token, quote);
+}
+
+/**
+ * Returns a quote based upon the data contained in the given MarkovFrozen
+ * model, never sampling a word in mask (which may be NULL). The caller is
+ * responsible for freeing the quote.
+*/
+char *markov_frozen_generate_quote(MarkovFrozen *frozen, const MarkovMask *mask) {
+  MarkovQuote words;
+  markov_frozen_generate_words(frozen, mask, &words);
+  char *quote = calloc(1, 1);
+  for (size_t i = 0; i < words.length; ++i) {
+    quote = add_word_to_quote(quote, words.words[i]);
+  }
+  return quote;
+}
+
+/**
+ * Writes generated quotes to a file descriptor without copying their words.
+ * Each quote is added as iovec entries pointing at the words in the model and
+ * at constant separators, and the buffered entries are written with a single
+ * writev() call when the buffer fills up or is flushed.
+*/
+typedef struct MarkovQuoteWriter {
+  int fd;
+  size_t count;
+  struct iovec iov[QUOTE_IOV_COUNT];
+} MarkovQuoteWriter;
+
+/**
+ * Writes every buffered entry of a MarkovQuoteWriter, retrying after partial
+ * writes, and empties the buffer.
+ *
+ * @return Returns false if writing failed.
+*/
+bool markov_quote_writer_flush(MarkovQuoteWriter *writer) {
+  struct iovec *iov = writer->iov;
+  size_t count = writer->count;
+  writer->count = 0;
+  while (count > 0) {
+    ssize_t written = writev(writer->fd, iov, count);
+    if (written < 0) {
+      perror("Unable to write quotes.");
+      return false;
+    }
+    while (count > 0 && (size_t)written >= iov->iov_len) {
+      written -= iov->iov_len;
+      iov++;
+      count--;
+    }
+    if (count > 0) {
+      iov->iov_base = (char *)iov->iov_base + written;
+      iov->iov_len -= written;
+    }
+  }
+  return true;
+}
+
+/**
+ * Adds one entry to a MarkovQuoteWriter. The data is referenced, not copied.
+*/
+void markov_quote_writer_push(MarkovQuoteWriter *writer, const char *data,
+                              size_t length) {
+  writer->iov[writer->count].iov_base = (void *)data;
+  writer->iov[writer->count].iov_len = length;
+  writer->count++;
+}
+
+/**
+ * Adds a quote to a MarkovQuoteWriter, formatted like the rest of the output
+ * of this program: the words joined by spaces, surrounded by blank lines. The
+ * words must stay valid until the writer is flushed.
+ *
+ * @return Returns false if a flush was needed and failed.
+*/
+bool markov_quote_writer_add(MarkovQuoteWriter *writer, MarkovQuote *quote) {
+  bool written = true;
+  if (writer->count + 2 * quote->length + 2 > QUOTE_IOV_COUNT) {
+    written = markov_quote_writer_flush(writer);
+  }
+  markov_quote_writer_push(writer, "\n", 1);
+  for (size_t i = 0; i < quote->length; ++i) {
+    if (i > 0) { markov_quote_writer_push(writer, " ", 1); }
+    markov_quote_writer_push(writer, quote->words[i], strlen(quote->words[i]));
+  }
+  markov_quote_writer_push(writer, "\n\n", 2);
+  return written;
+}
+
+/**
+ * The state of a MarkovTokenHandler streaming the words of one quote through
+ * a MarkovQuoteWriter.
+*/
+typedef struct MarkovQuoteStream {
+  MarkovQuoteWriter *writer;
+  size_t count;
+  bool written;
+} MarkovQuoteStream;
+
+/**
+ * A MarkovTokenHandler that writes each word out as soon as it is sampled.
+ * Cancels the quote if writing fails.
+*/
+bool markov_quote_writer_token(void *state, uint32_t id, const char *word,
+                               size_t length) {
+  (void)id;
+  MarkovQuoteStream *stream = state;
+  if (stream->count++ > 0) { markov_quote_writer_push(stream->writer, " ", 1); }
+  markov_quote_writer_push(stream->writer, word, length);
+  stream->written = markov_quote_writer_flush(stream->writer);
+  return stream->written;
+}
+
+/**
+ * Generates a quote and writes each of its words as soon as it is sampled,
+ * formatted like markov_quote_writer_add(), so the first word is out after
+ * one sampling step instead of a whole quote.
+ *
+ * @return Returns false if writing failed.
+*/
+bool markov_quote_writer_stream(MarkovQuoteWriter *writer, MarkovFrozen *frozen,
+                                const MarkovMask *mask) {
+  MarkovQuoteStream stream = { writer, 0, true };
+  if (writer->count + 1 > QUOTE_IOV_COUNT
+      && !markov_quote_writer_flush(writer)) { return false; }
+  markov_quote_writer_push(writer, "\n", 1);
+  markov_frozen_stream_words(frozen, mask, NULL, markov_quote_writer_token, &stream);
+  if (!stream.written) { return false; }
+  markov_quote_writer_push(writer, "\n\n", 2);
+  return markov_quote_writer_flush(writer);
+}
+
+/**
+ * The token separating the quotes of a MarkovSuffixIndex. It compares greater
+ * than every word id.
+*/
+#define MARKOV_SUFFIX_SEPARATOR (UINT32_MAX - 1)
+
+/**
+ * An index of a whole tokenized training file that finds the successors of a
+ * context of any length. Tokens holds the word ids of every quote, each
+ * preceded by MARKOV_SUFFIX_SEPARATOR, with a final separator after the last.
+ * Suffixes is the suffix array: the positions of tokens sorted by the tokens
+ * that follow them up to the next separator, ties broken by position. The
+ * suffixes starting with a context form one range of the array, and the token
+ * after each of them is one occurrence of a successor, so memory is linear in
+ * the size of the file whatever the context length.
+*/
+typedef struct MarkovSuffixIndex {
+  MarkovVocab *vocab;
+  size_t token_count;
+  size_t token_capacity;
+  uint32_t *tokens;
+  uint32_t *suffixes;
+} MarkovSuffixIndex;
+
+/**
+ * Returns the token at a position of a MarkovSuffixIndex, or the separator
+ * past the end.
+*/
+uint32_t markov_suffix_get_token(const MarkovSuffixIndex *index, size_t position) {
+  if (position >= index->token_count) { return MARKOV_SUFFIX_SEPARATOR; }
+  return index->tokens[position];
+}
+
+/**
+ * Compares the suffixes starting at two positions of a MarkovSuffixIndex in
+ * the order of the suffix array. Comparison stops at the first separator
+ * after the start, so it never runs past the end of a quote.
+*/
+int markov_suffix_compare(const MarkovSuffixIndex *index, uint32_t a, uint32_t b) {
+  for (size_t k = 0;; ++k) {
+    uint32_t token_a = markov_suffix_get_token(index, a + k);
+    uint32_t token_b = markov_suffix_get_token(index, b + k);
+    if (token_a != token_b) { return token_a < token_b ? -1 : 1; }
+    if (k > 0 && token_a == MARKOV_SUFFIX_SEPARATOR) { return a < b ? -1 : 1; }
+  }
+}
+
+/**
+ * Merges two sorted runs of suffix positions into out.
+*/
+void markov_suffix_merge(const MarkovSuffixIndex *index, const uint32_t *a,
+                         size_t a_count, const uint32_t *b, size_t b_count,
+                         uint32_t *out) {
+  size_t i = 0;
+  size_t j = 0;
+  while (i < a_count && j < b_count) {
+    *out++ = markov_suffix_compare(index, a[i], b[j]) <= 0 ? a[i++] : b[j++];
+  }
+  memcpy(out, a + i, (a_count - i) * sizeof(uint32_t));
+  memcpy(out + (a_count - i), b + j, (b_count - j) * sizeof(uint32_t));
+}
+
+/**
+ * Sorts an array of suffix positions with a merge sort, using temp, which
+ * must be as large, as scratch space.
+*/
+void markov_suffix_sort(const MarkovSuffixIndex *index, uint32_t *suffixes,
+                        uint32_t *temp, size_t count) {
+  if (count < 2) { return; }
+  size_t half = count / 2;
+  markov_suffix_sort(index, suffixes, temp, half);
+  markov_suffix_sort(index, suffixes + half, temp + half, count - half);
+  markov_suffix_merge(index, suffixes, half, suffixes + half, count - half, temp);
+  memcpy(suffixes, temp, count * sizeof(uint32_t));
+}
+
+/**
+ * One thread's share of building a suffix array: a run of positions to sort.
+*/
+typedef struct MarkovSuffixTask {
+  const MarkovSuffixIndex *index;
+  uint32_t *suffixes;
+  uint32_t *temp;
+  size_t count;
+  pthread_t thread;
+} MarkovSuffixTask;
+
+/**
+ * The body of a suffix array thread. Sorts its run of positions.
+*/
+void *markov_suffix_run(void *state) {
+  MarkovSuffixTask *task = state;
+  markov_suffix_sort(task->index, task->suffixes, task->temp, task->count);
+  return NULL;
+}
+
+/**
+ * A MarkovWordHandler that appends the id of a word to the tokens of a
+ * MarkovSuffixIndex, and a separator at the end of each quote.
+*/
+void markov_suffix_index_add_word(void *state, char *word) {
+  MarkovSuffixIndex *index = state;
+  uint32_t token =
+      word ? markov_vocab_intern(index->vocab, word) : MARKOV_SUFFIX_SEPARATOR;
+  if (!word && index->token_count > 0
+      && index->tokens[index->token_count - 1] == token) { return; }
+  if (index->token_count == index->token_capacity) {
+    index->token_capacity *= 2;
+    index->tokens = realloc(index->tokens, index->token_capacity * sizeof(uint32_t));
+  }
+  index->tokens[index->token_count++] = token;
+}
+
+/**
+ * Frees all the data associated with a MarkovSuffixIndex.
+*/
+void markov_suffix_index_free(MarkovSuffixIndex *index) {
+  if (!index) { return; }
+  markov_vocab_free(index->vocab);
+  free(index->tokens);
+  free(index->suffixes);
+  free(index);
+}
+
+/**
+ * Tokenizes a training file and builds its MarkovSuffixIndex, sorting
+ * thread_count runs of the suffix array in parallel and then merging them.
+ * Returns NULL if the file could not be loaded. The caller is responsible for
+ * freeing the index with markov_suffix_index_free().
+*/
+MarkovSuffixIndex *markov_suffix_index_new(const char *file_name, size_t thread_count) {
+  MarkovSuffixIndex *index = calloc(1, sizeof(MarkovSuffixIndex));
+  index->vocab = markov_vocab_new();
+  index->token_capacity = 1024;
+  index->tokens = malloc(index->token_capacity * sizeof(uint32_t));
+  markov_suffix_index_add_word(index, NULL);
+  if (!markov_file_for_each_word(file_name, markov_suffix_index_add_word, index)) {
+    markov_suffix_index_free(index);
+    return NULL;
+  }
+
+  size_t count = index->token_count;
+  index->suffixes = malloc(count * sizeof(uint32_t));
+  uint32_t *temp = malloc(count * sizeof(uint32_t));
+  for (size_t i = 0; i < count; ++i) {
+    index->suffixes[i] = i;
+  }
+  MarkovSuffixTask *tasks = calloc(thread_count, sizeof(MarkovSuffixTask));
+  size_t *runs = malloc((thread_count + 1) * sizeof(size_t));
+  for (size_t t = 0; t <= thread_count; ++t) {
+    runs[t] = count * t / thread_count;
+  }
+  for (size_t t = 0; t < thread_count; ++t) {
+    tasks[t].index = index;
+    tasks[t].suffixes = index->suffixes + runs[t];
+    tasks[t].temp = temp + runs[t];
+    tasks[t].count = runs[t + 1] - runs[t];
+    pthread_create(&tasks[t].thread, NULL, markov_suffix_run, &tasks[t]);
+  }
+  for (size_t t = 0; t < thread_count; ++t) {
+    pthread_join(tasks[t].thread, NULL);
+  }
+  /** Merge neighbouring runs until a single one is left */
+  for (size_t width = 1; width < thread_count; width *= 2) {
+    for (size_t t = 0; t + width < thread_count; t += 2 * width) {
+      size_t start = runs[t];
+      size_t middle = runs[t + width];
+      size_t end = runs[t + 2 * width < thread_count ? t + 2 * width : thread_count];
+      markov_suffix_merge(index, index->suffixes + start, middle - start,
+                          index->suffixes + middle, end - middle, temp + start);
+      memcpy(index->suffixes + start, temp + start, (end - start) * sizeof(uint32_t));
+    }
+  }
+  free(runs);
+  free(tasks);
+  free(temp);
+  return index;
+}
+
+/**
+ * Compares the suffix starting at a position of a MarkovSuffixIndex with a
+ * pattern of length tokens, returning 0 if the suffix starts with it.
+*/
+int markov_suffix_compare_pattern(const MarkovSuffixIndex *index, uint32_t position,
+                                  const uint32_t *pattern, size_t length) {
+  for (size_t k = 0; k < length; ++k) {
+    uint32_t token = markov_suffix_get_token(index, position + k);
+    if (token != pattern[k]) { return token < pattern[k] ? -1 : 1; }
+  }
+  return 0;
+}
+
+/**
+ * Finds the range [first, last) of the suffix array of a MarkovSuffixIndex
+ * whose suffixes start with a pattern, and returns its size.
+*/
+size_t markov_suffix_find(const MarkovSuffixIndex *index, const uint32_t *pattern,
+                          size_t length, size_t *first, size_t *last) {
+  size_t low = 0;
+  size_t high = index->token_count;
+  while (low < high) {
+    size_t middle = (low + high) / 2;
+    uint32_t suffix = index->suffixes[middle];
+    if (markov_suffix_compare_pattern(index, suffix, pattern, length) < 0) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+  *first = low;
+  high = index->token_count;
+  while (low < high) {
+    size_t middle = (low + high) / 2;
+    uint32_t suffix = index->suffixes[middle];
+    if (markov_suffix_compare_pattern(index, suffix, pattern, length) <= 0) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+  *last = low;
+  return *last - *first;
+}
+
+/**
+ * Generates a quote from a MarkovSuffixIndex into a MarkovQuote. Each word
+ * follows the longest suffix of the quote so far, including its start, that
+ * occurs at least SUFFIX_MIN_COUNT times in the training file, falling back
+ * to the last word alone. The occurrence count only shrinks as the suffix
+ * grows, so the length is found by binary search.
+*/
+void markov_suffix_generate_words(MarkovSuffixIndex *index, MarkovQuote *quote) {
+  uint32_t history[MAX_QUOTE_LENGTH + 2];
+  size_t history_length = 0;
+  history[history_length++] = MARKOV_SUFFIX_SEPARATOR;
+  quote->length = 0;
+  while (quote->length <= MAX_QUOTE_LENGTH) {
+    size_t first;
+    size_t last;
+    size_t shortest = 1;
+    size_t longest = history_length;
+    while (shortest < longest) {
+      size_t length = (shortest + longest + 1) / 2;
+      const uint32_t *pattern = history + history_length - length;
+      size_t count = markov_suffix_find(index, pattern, length, &first, &last);
+      if (count >= SUFFIX_MIN_COUNT) {
+        shortest = length;
+      } else {
+        longest = length - 1;
+      }
+    }
+    markov_suffix_find(index, history + history_length - shortest, shortest, &first,
+                       &last);
+    if (first == last) { break; }
+    uint32_t position =
+        index->suffixes[first + markov_random_next() % (last - first)] + shortest;
+    uint32_t token = markov_suffix_get_token(index, position);
+    if (token == MARKOV_SUFFIX_SEPARATOR) { break; }
+    history[history_length++] = token;
+    char *word = index->vocab->words[token];
+    quote->words[quote->length++] = word;
+    if (check_end_condition(word)) { break; }
+  }
+}
+
+/**
+ * Builds a MarkovSuffixIndex over a training file and writes quote_count
+ * quotes generated from it to stdout.
+ *
+ * @return Returns false if the file could not be loaded or writing failed.
+*/
+bool markov_suffix_write_quotes(const char *file_name, size_t quote_count) {
+  MarkovSuffixIndex *index = markov_suffix_index_new(file_name, SUFFIX_THREAD_COUNT);
+  if (!index) { return false; }
+  MarkovQuoteWriter *writer = calloc(1, sizeof(MarkovQuoteWriter));
+  writer->fd = STDOUT_FILENO;
+  MarkovQuote quote;
+  bool written = true;
+  for (size_t i = 0; i < quote_count && written; ++i) {
+    markov_suffix_generate_words(index, &quote);
+    written = markov_quote_writer_add(writer, &quote);
+  }
+  written = written && markov_quote_writer_flush(writer);
+  free(writer);
+  markov_suffix_index_free(index);
+  return written;
+}
+
+/**
+ * Generates the given number of quotes and discards them so that the hits of
+ * each context reflect how often generation visits it.
+*/
+void markov_frozen_profile(MarkovFrozen *frozen, size_t quote_count) {
+  MarkovQuote quote;
+  frozen->profiling = true;
+  for (size_t i = 0; i < quote_count; ++i) {
+    markov_frozen_generate_words(frozen, NULL, &quote);
+  }
+  frozen->profiling = false;
+}
+
+/**
+ * The sort key of a context used by markov_frozen_optimize_layout().
+*/
+typedef struct MarkovFrozenRank {
+  size_t hits;
+  uint32_t total;
+  uint32_t index;
+} MarkovFrozenRank;
+
+/**
+ * Compares two MarkovFrozenRank instances so that qsort() orders them from the
+ * hottest to the coldest context. Ties are broken by the total count and then
+ * by the original position so the order is deterministic.
+*/
+int markov_frozen_rank_compare(const void *a, const void *b) {
+  const MarkovFrozenRank *rank_a = a;
+  const MarkovFrozenRank *rank_b = b;
+  if (rank_a->hits != rank_b->hits) { return rank_a->hits < rank_b->hits ? 1 : -1; }
+  if (rank_a->total != rank_b->total) { return rank_a->total < rank_b->total ? 1 : -1; }
+  return rank_a->index < rank_b->index ? -1 : 1;
+}
+
+/**
+ * Reorders the contexts and successor blocks of a MarkovFrozen model from the
+ * hottest to the coldest context, using the recorded hits or, for contexts
+ * that were never visited, the total successor count. Hot contexts and their
+ * successors end up packed together at the front of their arrays. Returns the
+ * number of contexts that were visited at least once.
+*/
+size_t markov_frozen_optimize_layout(MarkovFrozen *frozen) {
+  MarkovFrozenRank *ranks = malloc(frozen->context_count * sizeof(MarkovFrozenRank));
+  for (uint32_t i = 0; i < frozen->context_count; ++i) {
+    ranks[i].hits = frozen->hits[i];
+    ranks[i].total = frozen->contexts[i].total;
+    ranks[i].index = i;
+  }
+  qsort(ranks, frozen->context_count, sizeof(MarkovFrozenRank),
+        markov_frozen_rank_compare);
+
+  MarkovFrozenContext *contexts =
+      malloc(frozen->context_count * sizeof(MarkovFrozenContext));
+  MarkovFrozenSuccessor *successors =
+      malloc(frozen->successor_count * sizeof(MarkovFrozenSuccessor));
+  size_t *hits = malloc(frozen->context_count * sizeof(size_t));
+  size_t hot_count = 0;
+  uint32_t first = 0;
+  for (size_t i = 0; i < frozen->context_count; ++i) {
+    MarkovFrozenContext *context = &frozen->contexts[ranks[i].index];
+    memcpy(&successors[first], &frozen->successors[context->first],
+           context->length * sizeof(MarkovFrozenSuccessor));
+    contexts[i] = *context;
+    contexts[i].first = first;
+    first += context->length;
+    hits[i] = ranks[i].hits;
+    if (hits[i] > 0) { hot_count++; }
+  }
+  free(ranks);
+  free(frozen->contexts);
+  free(frozen->successors);
+  free(frozen->hits);
+  frozen->contexts = contexts;
+  frozen->successors = successors;
+  frozen->hits = hits;
+  frozen->context_capacity = 0;
+  frozen->successor_count = first;
+  frozen->successor_capacity = 0;
+  frozen->dead_successors = 0;
+  markov_frozen_build_index(frozen);
+  return hot_count;
+}
+
+/**
+ * Prefaults the pages of a memory range, advises the kernel that they will be
+ * needed and, if FROZEN_LOCK_HOT_PAGES is set, locks them in memory.
+*/
+void prewarm_pages(void *data, size_t length) {
+  if (length == 0) { return; }
+  size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+  uintptr_t start = (uintptr_t)data & ~(page_size - 1);
+  uintptr_t end = (uintptr_t)data + length;
+  madvise((void *)start, end - start, MADV_WILLNEED);
+  for (uintptr_t page = start; page < end; page += page_size) {
+    (void)*(volatile char *)(page < (uintptr_t)data ? (uintptr_t)data : page);
+  }
+  if (FROZEN_LOCK_HOT_PAGES && mlock((void *)start, end - start) != 0) {
+    perror("Unable to lock hot pages.");
+  }
+}
+
+/**
+ * Prefaults the memory holding the first hot_count contexts of a MarkovFrozen
+ * model, their successor blocks, and the index, so that the first quotes do
+ * not pay for page faults.
+*/
+void markov_frozen_prewarm(MarkovFrozen *frozen, size_t hot_count) {
+  if (hot_count == 0) { return; }
+  MarkovFrozenContext *last = &frozen->contexts[hot_count - 1];
+  prewarm_pages(frozen->contexts, hot_count * sizeof(MarkovFrozenContext));
+  prewarm_pages(frozen->successors,
+                (last->first + last->length) * sizeof(MarkovFrozenSuccessor));
+  prewarm_pages(frozen->slots, frozen->slot_count * sizeof(uint32_t));
+}
+
+/**
+ * Moves the successors of a MarkovFrozen model into a MarkovPageStore with a
+ * cache of PAGE_CACHE_PAGES decompressed pages, or does nothing if
+ * PAGE_CACHE_PAGES is 0. Compress after optimizing the layout, so hot blocks
+ * share pages.
+*/
+void markov_frozen_compress(MarkovFrozen *frozen) {
+  if (!PAGE_CACHE_PAGES || frozen->successor_count == 0) { return; }
+  frozen->pages = markov_page_store_new(frozen->successors, frozen->contexts,
+                                        frozen->context_count, PAGE_CACHE_PAGES);
+  free(frozen->successors);
+  frozen->successors = NULL;
+}
+
+/**
+ * Prints the latency of the first quote and the mean latency of the following
+ * quote_count quotes generated from a MarkovFrozen model to stderr.
+*/
+void markov_frozen_report_latency(MarkovFrozen *frozen, const char *label,
+                                  size_t quote_count) {
+  double start = get_time_seconds();
+  free(markov_frozen_generate_quote(frozen, NULL));
+  double first = get_time_seconds() - start;
+  start = get_time_seconds();
+  for (size_t i = 0; i < quote_count; ++i) {
+    free(markov_frozen_generate_quote(frozen, NULL));
+  }
+  double steady = (get_time_seconds() - start) / quote_count;
+  fprintf(stderr, "%s: first quote %.2f us, steady state %.2f us/quote\n",
+          label, first * 1e6, steady * 1e6);
+}
+
+/**
+ * Returns the count of a successor within the block of the context at the
+ * given position of a MarkovFrozen model, or 0 if it is not a successor.
+*/
+uint32_t markov_frozen_get_count(MarkovFrozen *frozen, uint32_t index, uint32_t word) {
+  MarkovFrozenContext *context = &frozen->contexts[index];
+  MarkovFrozenSuccessor *block;
+  MarkovPageEntry *entry = markov_frozen_acquire_block(frozen, context, &block);
+  uint32_t count = 0;
+  for (size_t i = 0; i < context->length; ++i) {
+    if (block[i].word == word) {
+      count = block[i].cumulative - (i > 0 ? block[i - 1].cumulative : 0);
+      break;
+    }
+  }
+  markov_frozen_release_block(frozen, entry);
+  return count;
+}
+
+/**
+ * The state threaded through markov_file_for_each_word() while scoring a file
+ * against a MarkovFrozen model.
+*/
+typedef struct MarkovScoreState {
+  MarkovFrozen *frozen;
+  uint32_t words[MARKOV_CONTEXT_SIZE];
+  double log_sum;
+  size_t word_count;
+  size_t unseen_count;
+} MarkovScoreState;
+
+/**
+ * A MarkovWordHandler that adds the log probability the model assigns to a
+ * word in its context. Words the model cannot predict are counted as unseen.
+ * Words removed by the vocabulary cap are scored as OOV_WORD.
+*/
+void markov_frozen_score_word(void *state, char *word) {
+  MarkovScoreState *score = state;
+  if (!word) {
+    for (size_t i = 0; i < MARKOV_CONTEXT_SIZE; ++i) {
+      score->words[i] = MARKOV_NO_WORD;
+    }
+    return;
+  }
+  MarkovFrozen *frozen = score->frozen;
+  MarkovClasses *classes = frozen->classes;
+  if (frozen->oov) {
+    word = markov_oov_map_word(frozen->oov, word);
+  }
+  char *token = classes ? markov_classes_get_label(classes, word) : word;
+  uint32_t id = markov_vocab_find(frozen->vocab, token);
+  uint32_t index = markov_frozen_find(frozen, score->words);
+  uint32_t count =
+      index == MARKOV_NO_WORD ? 0 : markov_frozen_get_count(frozen, index, id);
+  if (count == 0) {
+    score->unseen_count++;
+  } else {
+    double probability = (double)count / frozen->contexts[index].total;
+    if (classes) {
+      uint32_t word_id = markov_vocab_find(classes->vocab, word);
+      probability *= (double)classes->vocab->counts[word_id]
+                     / classes->counts[classes->word_classes[word_id]];
+    }
+    score->log_sum += log2(probability);
+    score->word_count++;
+  }
+  memmove(score->words, score->words + 1, (MARKOV_CONTEXT_SIZE - 1) * sizeof(uint32_t));
+  score->words[MARKOV_CONTEXT_SIZE - 1] = id;
+}
+
+/**
+ * Scores a file of quotes against a MarkovFrozen model and prints the per-word
+ * perplexity, the number of words the model could not predict, and the size of
+ * the model to stderr.
+*/
+void markov_frozen_report_score(MarkovFrozen *frozen, const char *file_name) {
+  MarkovScoreState score = { .frozen = frozen };
+  markov_frozen_score_word(&score, NULL);
+  if (!markov_file_for_each_word(file_name, markov_frozen_score_word, &score)) {
+    return;
+  }
+  double perplexity = score.word_count ? exp2(-score.log_sum / score.word_count) : 0.0;
+  fprintf(stderr, "%zu contexts, %zu successors, perplexity %.2f, %zu unseen words\n",
+          frozen->context_count, frozen->successor_count, perplexity,
+          score.unseen_count);
+}
+
+/**
+ * Compares masked sampling against post-filtering for a mask and prints to
+ * stderr how many words each samples per delivered quote. Post-filtering
+ * generates unmasked quotes and rejects those containing a masked word.
+*/
+void markov_frozen_report_mask(MarkovFrozen *frozen, const MarkovMask *mask,
+                               size_t quote_count) {
+  MarkovQuote quote;
+  size_t masked_words = 0;
+  for (size_t i = 0; i < quote_count; ++i) {
+    markov_frozen_generate_words(frozen, mask, &quote);
+    masked_words += quote.length;
+  }
+  size_t filtered_words = 0;
+  size_t rejected = 0;
+  for (size_t i = 0; i < quote_count; ++i) {
+    bool accepted = false;
+    for (size_t attempt = 0; attempt < 1000 && !accepted; ++attempt) {
+      markov_frozen_generate_words(frozen, NULL, &quote);
+      filtered_words += quote.length;
+      accepted = true;
+      for (size_t j = 0; j < quote.length && accepted; ++j) {
+        uint32_t id = markov_vocab_find(frozen->vocab, quote.words[j]);
+        accepted = !markov_mask_test(mask, id);
+      }
+      if (!accepted) { rejected++; }
+    }
+  }
+  fprintf(stderr, "masked sampling: %.2f words/quote; "
+          "post-filtering: %.2f words/quote, %zu rejected quotes\n",
+          (double)masked_words / quote_count, (double)filtered_words / quote_count,
+          rejected);
+}
+
+/**
+ * Frees all the data associated with a MarkovFrozen model.
+*/
+void markov_frozen_free(MarkovFrozen *frozen) {
+  if (!frozen) { return; }
+  if (!frozen->shared_vocab) {
+    markov_vocab_free(frozen->vocab);
+  }
+  markov_classes_free(frozen->classes);
+  markov_oov_free(frozen->oov);
+  free(frozen->hits);
+  markov_page_store_free(frozen->pages);
+  if (frozen->image) {
+    munmap(frozen->image, frozen->image_size);
+  } else {
+    free(frozen->contexts);
+    free(frozen->successors);
+    free(frozen->slots);
+  }
+  free(frozen);
+}
+
+/**
+ * The frozen model seen as a sparse transition matrix over its contexts, in
+ * CSR form. Row i holds the contexts reached from context i by appending one
+ * of its successors, with the probability of each transition. Transitions to a
+ * context the model does not know end the quote; their probability is summed
+ * in exits. Incoming holds the same matrix transposed, so power iteration can
+ * pull each row of the next vector without synchronizing writers. Start is
+ * the context every quote begins from, or MARKOV_NO_WORD if there is none.
+*/
+typedef struct MarkovGraph {
+  size_t state_count;
+  size_t edge_count;
+  size_t *offsets;
+  uint32_t *targets;
+  double *weights;
+  double *exits;
+  size_t *incoming_offsets;
+  uint32_t *incoming_sources;
+  double *incoming_weights;
+  uint32_t start;
+} MarkovGraph;
+
+/**
+ * Builds the transition graph of a MarkovFrozen model. The caller is
+ * responsible for freeing the graph with markov_graph_free().
+*/
+MarkovGraph *markov_graph_new(MarkovFrozen *frozen) {
+  MarkovGraph *graph = calloc(1, sizeof(MarkovGraph));
+  size_t state_count = frozen->context_count;
+  graph->state_count = state_count;
+  graph->offsets = calloc(state_count + 1, sizeof(size_t));
+  graph->targets = malloc((frozen->successor_count + 1) * sizeof(uint32_t));
+  graph->weights = malloc((frozen->successor_count + 1) * sizeof(double));
+  graph->exits = calloc(state_count + 1, sizeof(double));
+  for (size_t i = 0; i < state_count; ++i) {
+    MarkovFrozenContext *context = &frozen->contexts[i];
+    MarkovFrozenSuccessor *block;
+    MarkovPageEntry *entry = markov_frozen_acquire_block(frozen, context, &block);
+    uint32_t words[MARKOV_CONTEXT_SIZE];
+    memcpy(words, context->words + 1, (MARKOV_CONTEXT_SIZE - 1) * sizeof(uint32_t));
+    for (size_t j = 0; j < context->length; ++j) {
+      uint32_t previous = j > 0 ? block[j - 1].cumulative : 0;
+      double weight = (double)(block[j].cumulative - previous) / context->total;
+      words[MARKOV_CONTEXT_SIZE - 1] = block[j].word;
+      uint32_t target = markov_frozen_find(frozen, words);
+      if (target == MARKOV_NO_WORD) {
+        graph->exits[i] += weight;
+      } else {
+        graph->targets[graph->edge_count] = target;
+        graph->weights[graph->edge_count] = weight;
+        graph->edge_count++;
+      }
+    }
+    markov_frozen_release_block(frozen, entry);
+    graph->offsets[i + 1] = graph->edge_count;
+  }
+
+  graph->incoming_offsets = calloc(state_count + 2, sizeof(size_t));
+  graph->incoming_sources = malloc((graph->edge_count + 1) * sizeof(uint32_t));
+  graph->incoming_weights = malloc((graph->edge_count + 1) * sizeof(double));
+  for (size_t e = 0; e < graph->edge_count; ++e) {
+    graph->incoming_offsets[graph->targets[e] + 2]++;
+  }
+  for (size_t i = 2; i < state_count + 2; ++i) {
+    graph->incoming_offsets[i] += graph->incoming_offsets[i - 1];
+  }
+  for (size_t i = 0; i < state_count; ++i) {
+    for (size_t e = graph->offsets[i]; e < graph->offsets[i + 1]; ++e) {
+      size_t position = graph->incoming_offsets[graph->targets[e] + 1]++;
+      graph->incoming_sources[position] = i;
+      graph->incoming_weights[position] = graph->weights[e];
+    }
+  }
+
+  uint32_t start[MARKOV_CONTEXT_SIZE];
+  for (size_t i = 0; i < MARKOV_CONTEXT_SIZE; ++i) {
+    start[i] = MARKOV_NO_WORD;
+  }
+  graph->start = state_count ? markov_frozen_find(frozen, start) : MARKOV_NO_WORD;
+  return graph;
+}
+
+/**
+ * The state shared by the power iteration threads. The coordinating thread
+ * sets up each step between two waits on the step barrier, and the workers
+ * compute their rows between the same two waits, so the threads are started
+ * once for the whole computation.
+*/
+typedef struct MarkovGraphSolver {
+  MarkovGraph *graph;
+  const double *current;
+  double *next;
+  double keep;
+  double restart;
+  bool done;
+  pthread_barrier_t step;
+} MarkovGraphSolver;
+
+/**
+ * One thread's share of each power iteration step: the rows [first, last) of
+ * the next vector and their L1 distance from the current vector.
+*/
+typedef struct MarkovGraphTask {
+  MarkovGraphSolver *solver;
+  size_t first;
+  size_t last;
+  double change;
+  pthread_t thread;
+} MarkovGraphTask;
+
+/**
+ * The body of a power iteration thread. For each step, pulls each of its rows
+ * of the next vector from the incoming transitions, scaled by keep, adding the
+ * restarted mass to the start context. Returns once the solver is done.
+*/
+void *markov_graph_step(void *state) {
+  MarkovGraphTask *task = state;
+  MarkovGraphSolver *solver = task->solver;
+  MarkovGraph *graph = solver->graph;
+  while (true) {
+    pthread_barrier_wait(&solver->step);
+    if (solver->done) { return NULL; }
+    task->change = 0.0;
+    for (size_t i = task->first; i < task->last; ++i) {
+      double sum = i == graph->start ? solver->restart : 0.0;
+      for (size_t e = graph->incoming_offsets[i]; e < graph->incoming_offsets[i + 1];
+           ++e) {
+        double weight = graph->incoming_weights[e];
+        sum += solver->keep * solver->current[graph->incoming_sources[e]] * weight;
+      }
+      solver->next[i] = sum;
+      task->change += fabs(sum - solver->current[i]);
+    }
+    pthread_barrier_wait(&solver->step);
+  }
+}
+
+/**
+ * Returns the stationary distribution of the chain that restarts at the start
+ * context whenever a quote ends, computed by power iteration with
+ * thread_count threads until the L1 change drops below ANALYSIS_TOLERANCE or
+ * ANALYSIS_MAX_ITERATIONS is reached. Like the generator, the chain also
+ * restarts after MAX_QUOTE_LENGTH words on average, so traps cannot absorb
+ * all the mass and periodic cycles still converge. Sets iterations to the
+ * number of steps taken. The caller is responsible for freeing the returned
+ * array.
+*/
+double *markov_graph_stationary(MarkovGraph *graph, size_t thread_count,
+                                size_t *iterations) {
+  size_t state_count = graph->state_count;
+  double *current = malloc((state_count + 1) * sizeof(double));
+  double *next = malloc((state_count + 1) * sizeof(double));
+  for (size_t i = 0; i < state_count; ++i) {
+    current[i] = 1.0 / state_count;
+  }
+  MarkovGraphSolver solver;
+  solver.graph = graph;
+  solver.done = false;
+  pthread_barrier_init(&solver.step, NULL, thread_count + 1);
+  MarkovGraphTask *tasks = calloc(thread_count, sizeof(MarkovGraphTask));
+  for (size_t t = 0; t < thread_count; ++t) {
+    tasks[t].solver = &solver;
+    tasks[t].first = state_count * t / thread_count;
+    tasks[t].last = state_count * (t + 1) / thread_count;
+    pthread_create(&tasks[t].thread, NULL, markov_graph_step, &tasks[t]);
+  }
+  *iterations = 0;
+  double change = 1.0;
+  while (change > ANALYSIS_TOLERANCE && *iterations < ANALYSIS_MAX_ITERATIONS) {
+    /** Without a start context ended quotes spread evenly over every state */
+    double keep = 1.0 - 1.0 / MAX_QUOTE_LENGTH;
+    double restart = 1.0 - keep;
+    for (size_t i = 0; i < state_count; ++i) {
+      restart += keep * current[i] * graph->exits[i];
+    }
+    solver.current = current;
+    solver.next = next;
+    solver.keep = keep;
+    solver.restart = restart;
+    pthread_barrier_wait(&solver.step);
+    pthread_barrier_wait(&solver.step);
+    change = 0.0;
+    for (size_t t = 0; t < thread_count; ++t) {
+      change += tasks[t].change;
+    }
+    if (graph->start == MARKOV_NO_WORD) {
+      change = 0.0;
+      for (size_t i = 0; i < state_count; ++i) {
+        double value = next[i] + restart / state_count;
+        change += fabs(value - current[i]);
+        next[i] = value;
+      }
+    }
+    double *temp = current;
+    current = next;
+    next = temp;
+    (*iterations)++;
+  }
+  solver.done = true;
+  pthread_barrier_wait(&solver.step);
+  for (size_t t = 0; t < thread_count; ++t) {
+    pthread_join(tasks[t].thread, NULL);
+  }
+  pthread_barrier_destroy(&solver.step);
+  free(tasks);
+  free(next);
+  return current;
+}
+
+/**
+ * Labels the strongly connected components of the graph with Tarjan's
+ * algorithm, using an explicit stack so deep chains cannot overflow the call
+ * stack. Sets components[i] to the component of state i and returns the
+ * number of components.
+*/
+size_t markov_graph_components(MarkovGraph *graph, uint32_t *components) {
+  size_t state_count = graph->state_count;
+  uint32_t *order = malloc((state_count + 1) * sizeof(uint32_t));
+  uint32_t *low = malloc((state_count + 1) * sizeof(uint32_t));
+  uint32_t *stack = malloc((state_count + 1) * sizeof(uint32_t));
+  uint32_t *calls = malloc((state_count + 1) * sizeof(uint32_t));
+  size_t *edges = malloc((state_count + 1) * sizeof(size_t));
+  bool *on_stack = calloc(state_count + 1, sizeof(bool));
+  for (size_t i = 0; i < state_count; ++i) {
+    order[i] = MARKOV_NO_WORD;
+  }
+  size_t visited = 0;
+  size_t stack_size = 0;
+  size_t component_count = 0;
+  for (size_t root = 0; root < state_count; ++root) {
+    if (order[root] != MARKOV_NO_WORD) { continue; }
+    size_t call_count = 0;
+    calls[call_count++] = root;
+    order[root] = low[root] = visited++;
+    edges[root] = graph->offsets[root];
+    stack[stack_size++] = root;
+    on_stack[root] = true;
+    while (call_count > 0) {
+      uint32_t state = calls[call_count - 1];
+      if (edges[state] < graph->offsets[state + 1]) {
+        uint32_t target = graph->targets[edges[state]++];
+        if (order[target] == MARKOV_NO_WORD) {
+          order[target] = low[target] = visited++;
+          edges[target] = graph->offsets[target];
+          stack[stack_size++] = target;
+          on_stack[target] = true;
+          calls[call_count++] = target;
+        } else if (on_stack[target] && order[target] < low[state]) {
+          low[state] = order[target];
+        }
+        continue;
+      }
+      call_count--;
+      if (call_count > 0 && low[state] < low[calls[call_count - 1]]) {
+        low[calls[call_count - 1]] = low[state];
+      }
+      if (low[state] == order[state]) {
+        uint32_t member;
+        do {
+          member = stack[--stack_size];
+          on_stack[member] = false;
+          components[member] = component_count;
+        } while (member != state);
+        component_count++;
+      }
+    }
+  }
+  free(order);
+  free(low);
+  free(stack);
+  free(calls);
+  free(edges);
+  free(on_stack);
+  return component_count;
+}
+
+/**
+ * Writes the words of a context of a MarkovFrozen model to a file, separated
+ * by spaces, with <s> standing for the start of a quote.
+*/
+void markov_frozen_write_context(MarkovFrozen *frozen, FILE *file, uint32_t index) {
+  for (size_t i = 0; i < MARKOV_CONTEXT_SIZE; ++i) {
+    uint32_t word = frozen->contexts[index].words[i];
+    fprintf(file, "%s%s", i > 0 ? " " : "",
+            word == MARKOV_NO_WORD ? "<s>" : frozen->vocab->words[word]);
+  }
+}
+
+/**
+ * Exports the transition matrix of a graph in CSR form as four text files with
+ * one value per line: prefix.indptr holds the row offsets, prefix.indices the
+ * target states, prefix.data the transition probabilities and prefix.states
+ * the context of each state.
+ *
+ * @return Returns false if a file could not be written.
+*/
+bool markov_graph_export(MarkovGraph *graph, MarkovFrozen *frozen, const char *prefix) {
+  const char *suffixes[] = { "indptr", "indices", "data", "states" };
+  bool written = true;
+  for (size_t f = 0; f < 4 && written; ++f) {
+    char name[MARKOV_LINE_SIZE];
+    snprintf(name, sizeof(name), "%s.%s", prefix, suffixes[f]);
+    FILE *file = fopen(name, "w");
+    if (!file) {
+      perror("Unable to open file.");
+      return false;
+    }
+    if (f == 0) {
+      for (size_t i = 0; i <= graph->state_count; ++i) {
+        fprintf(file, "%zu\n", graph->offsets[i]);
+      }
+    } else if (f == 1 || f == 2) {
+      for (size_t e = 0; e < graph->edge_count; ++e) {
+        if (f == 1) {
+          fprintf(file, "%u\n", graph->targets[e]);
+        } else {
+          fprintf(file, "%.17g\n", graph->weights[e]);
+        }
+      }
+    } else {
+      for (size_t i = 0; i < graph->state_count; ++i) {
+        markov_frozen_write_context(frozen, file, i);
+        fputc('\n', file);
+      }
+    }
+    written = fclose(file) == 0;
+  }
+  return written;
+}
+
+/**
+ * Frees all the data associated with a MarkovGraph.
+*/
+void markov_graph_free(MarkovGraph *graph) {
+  if (!graph) { return; }
+  free(graph->offsets);
+  free(graph->targets);
+  free(graph->weights);
+  free(graph->exits);
+  free(graph->incoming_offsets);
+  free(graph->incoming_sources);
+  free(graph->incoming_weights);
+  free(graph);
+}
+
+/**
+ * A state of the transition graph and its stationary probability, sorted to
+ * find the states the generator gravitates to.
+*/
+typedef struct MarkovGraphRank {
+  uint32_t state;
+  double probability;
+} MarkovGraphRank;
+
+/**
+ * Compares two MarkovGraphRank instances by descending probability. Used with
+ * qsort.
+*/
+int markov_graph_rank_compare(const void *a, const void *b) {
+  double probability_a = ((const MarkovGraphRank *)a)->probability;
+  double probability_b = ((const MarkovGraphRank *)b)->probability;
+  return (probability_a < probability_b) - (probability_a > probability_b);
+}
+
+/**
+ * Prints an analysis of the transition graph of a MarkovFrozen model: the
+ * ANALYSIS_TOP_STATES states with the highest stationary probability, dead
+ * ends (every transition ends the quote), states unreachable from the start
+ * context, and the strongly connected components, including traps: components
+ * with no way out, which only MAX_QUOTE_LENGTH ends. When prefix is not NULL
+ * the transition matrix is exported in CSR form as well.
+ *
+ * @return Returns false if the export failed.
+*/
+bool markov_frozen_report_graph(MarkovFrozen *frozen, const char *prefix) {
+  MarkovGraph *graph = markov_graph_new(frozen);
+  size_t state_count = graph->state_count;
+  printf("%zu states, %zu transitions\n", state_count, graph->edge_count);
+  if (state_count == 0) {
+    markov_graph_free(graph);
+    return true;
+  }
+
+  size_t iterations;
+  double start = get_time_seconds();
+  double *stationary = markov_graph_stationary(graph, ANALYSIS_THREAD_COUNT,
+                                               &iterations);
+  printf("stationary distribution: %zu iterations in %.2f ms\n", iterations,
+         (get_time_seconds() - start) * 1e3);
+  MarkovGraphRank *ranks = malloc(state_count * sizeof(MarkovGraphRank));
+  for (size_t i = 0; i < state_count; ++i) {
+    ranks[i] = (MarkovGraphRank){ i, stationary[i] };
+  }
+  qsort(ranks, state_count, sizeof(MarkovGraphRank), markov_graph_rank_compare);
+  for (size_t i = 0; i < ANALYSIS_TOP_STATES && i < state_count; ++i) {
+    printf("  %.6f  ", ranks[i].probability);
+    markov_frozen_write_context(frozen, stdout, ranks[i].state);
+    printf("\n");
+  }
+
+  size_t dead_ends = 0;
+  for (size_t i = 0; i < state_count; ++i) {
+    dead_ends += graph->offsets[i] == graph->offsets[i + 1];
+  }
+  bool *reached = calloc(state_count, sizeof(bool));
+  uint32_t *queue = malloc(state_count * sizeof(uint32_t));
+  size_t queue_length = 0;
+  if (graph->start != MARKOV_NO_WORD) {
+    reached[graph->start] = true;
+    queue[queue_length++] = graph->start;
+  }
+  for (size_t head = 0; head < queue_length; ++head) {
+    for (size_t e = graph->offsets[queue[head]]; e < graph->offsets[queue[head] + 1];
+         ++e) {
+      if (!reached[graph->targets[e]]) {
+        reached[graph->targets[e]] = true;
+        queue[queue_length++] = graph->targets[e];
+      }
+    }
+  }
+  printf("%zu dead ends, %zu unreachable states\n", dead_ends,
+         state_count - queue_length);
+
+  uint32_t *components = malloc(state_count * sizeof(uint32_t));
+  size_t component_count = markov_graph_components(graph, components);
+  size_t *sizes = calloc(component_count, sizeof(size_t));
+  bool *open = calloc(component_count, sizeof(bool));
+  for (size_t i = 0; i < state_count; ++i) {
+    sizes[components[i]]++;
+    open[components[i]] = open[components[i]] || graph->exits[i] > 0.0;
+    for (size_t e = graph->offsets[i]; e < graph->offsets[i + 1]; ++e) {
+      open[components[i]] = open[components[i]]
+          || components[graph->targets[e]] != components[i];
+    }
+  }
+  size_t largest = 0;
+  size_t traps = 0;
+  size_t trapped_states = 0;
+  for (size_t c = 0; c < component_count; ++c) {
+    if (sizes[c] > largest) { largest = sizes[c]; }
+    if (!open[c]) {
+      traps++;
+      trapped_states += sizes[c];
+    }
+  }
+  printf("%zu strongly connected components, largest %zu states, "
+         "%zu traps holding %zu states\n",
+         component_count, largest, traps, trapped_states);
+
+  bool exported = !prefix || markov_graph_export(graph, frozen, prefix);
+  free(sizes);
+  free(open);
+  free(components);
+  free(queue);
+  free(reached);
+  free(ranks);
+  free(stationary);
+  markov_graph_free(graph);
+  return exported;
+}
+
+/**
+ * A context, or a context and one of its successors, of a MarkovFrozen model
+ * with its count. Word is MARKOV_NO_WORD for a context on its own. Strings are
+ * only looked up when the report is printed.
+*/
+typedef struct MarkovNgram {
+  uint32_t count;
+  uint32_t context;
+  uint32_t word;
+} MarkovNgram;
+
+/**
+ * Compares two MarkovNgram instances by descending count. Used with qsort.
+*/
+int markov_ngram_compare(const void *a, const void *b) {
+  uint32_t count_a = ((const MarkovNgram *)a)->count;
+  uint32_t count_b = ((const MarkovNgram *)b)->count;
+  return (count_a < count_b) - (count_a > count_b);
+}
+
+/**
+ * A min-heap by count holding the most frequent MarkovNgram instances seen,
+ * up to TOP_NGRAM_COUNT.
+*/
+typedef struct MarkovNgramHeap {
+  size_t count;
+  MarkovNgram ngrams[TOP_NGRAM_COUNT + 1];
+} MarkovNgramHeap;
+
+/**
+ * Adds an n-gram to a MarkovNgramHeap, replacing the least frequent one when
+ * the heap is full and the new one is more frequent.
+*/
+void markov_ngram_heap_add(MarkovNgramHeap *heap, MarkovNgram ngram) {
+  markov_top_heap_add(heap->ngrams, &heap->count, TOP_NGRAM_COUNT, sizeof(MarkovNgram),
+                      &ngram, markov_ngram_compare);
+}
+
+/**
+ * One thread's share of the n-gram report: the contexts [first, last) of a
+ * MarkovFrozen model and the heaps of its most frequent contexts and pairs.
+ * Contexts holding the start of a quote are skipped, and when word is not
+ * MARKOV_NO_WORD only n-grams containing it are counted.
+*/
+typedef struct MarkovNgramTask {
+  MarkovFrozen *frozen;
+  uint32_t word;
+  size_t first;
+  size_t last;
+  MarkovNgramHeap contexts;
+  MarkovNgramHeap pairs;
+  pthread_t thread;
+} MarkovNgramTask;
+
+/**
+ * The body of an n-gram thread. Scans its contexts and their successor blocks
+ * in the frozen arrays.
+*/
+void *markov_ngram_run(void *state) {
+  MarkovNgramTask *task = state;
+  MarkovFrozen *frozen = task->frozen;
+  for (size_t i = task->first; i < task->last; ++i) {
+    MarkovFrozenContext *context = &frozen->contexts[i];
+    bool has_word = task->word == MARKOV_NO_WORD;
+    bool has_start = false;
+    for (size_t j = 0; j < MARKOV_CONTEXT_SIZE; ++j) {
+      has_word = has_word || context->words[j] == task->word;
+      has_start = has_start || context->words[j] == MARKOV_NO_WORD;
+    }
+    if (has_start) { continue; }
+    if (has_word) {
+      markov_ngram_heap_add(&task->contexts,
+                            (MarkovNgram){ context->total, i, MARKOV_NO_WORD });
+    }
+    MarkovFrozenSuccessor *block;
+    MarkovPageEntry *entry = markov_frozen_acquire_block(frozen, context, &block);
+    for (size_t j = 0; j < context->length; ++j) {
+      if (has_word || block[j].word == task->word) {
+        uint32_t count = block[j].cumulative - (j > 0 ? block[j - 1].cumulative : 0);
+        markov_ngram_heap_add(&task->pairs, (MarkovNgram){ count, i, block[j].word });
+      }
+    }
+    markov_frozen_release_block(frozen, entry);
+  }
+  return NULL;
+}
+
+/**
+ * Merges the heaps of every thread, then prints the TOP_NGRAM_COUNT most
+ * frequent n-grams among them.
+*/
+void markov_ngram_print(MarkovFrozen *frozen, MarkovNgramTask *tasks,
+                        size_t thread_count, bool pairs) {
+  MarkovNgram *ngrams =
+      malloc(thread_count * TOP_NGRAM_COUNT * sizeof(MarkovNgram) + 1);
+  size_t count = 0;
+  for (size_t t = 0; t < thread_count; ++t) {
+    MarkovNgramHeap *heap = pairs ? &tasks[t].pairs : &tasks[t].contexts;
+    memcpy(ngrams + count, heap->ngrams, heap->count * sizeof(MarkovNgram));
+    count += heap->count;
+  }
+  qsort(ngrams, count, sizeof(MarkovNgram), markov_ngram_compare);
+  printf("top %s:\n", pairs ? "context and successor pairs" : "contexts");
+  for (size_t i = 0; i < count && i < TOP_NGRAM_COUNT; ++i) {
+    printf("  %6u  ", ngrams[i].count);
+    markov_frozen_write_context(frozen, stdout, ngrams[i].context);
+    if (pairs) {
+      printf(" -> %s", frozen->vocab->words[ngrams[i].word]);
+    }
+    printf("\n");
+  }
+  free(ngrams);
+}
+
+/**
+ * Prints the TOP_NGRAM_COUNT most frequent contexts and context and successor
+ * pairs of a MarkovFrozen model, optionally only those containing a word,
+ * using thread_count threads that each keep bounded heaps over a range of
+ * contexts. Contexts holding the start of a quote are left out.
+*/
+void markov_frozen_report_ngrams(MarkovFrozen *frozen, const char *word,
+                                 size_t thread_count) {
+  uint32_t id = MARKOV_NO_WORD;
+  if (word) {
+    id = markov_vocab_find(frozen->vocab, word);
+    if (id == MARKOV_NO_WORD) {
+      printf("'%s' is not in the model\n", word);
+      return;
+    }
+  }
+  MarkovNgramTask *tasks = calloc(thread_count, sizeof(MarkovNgramTask));
+  for (size_t t = 0; t < thread_count; ++t) {
+    tasks[t].frozen = frozen;
+    tasks[t].word = id;
+    tasks[t].first = frozen->context_count * t / thread_count;
+    tasks[t].last = frozen->context_count * (t + 1) / thread_count;
+    pthread_create(&tasks[t].thread, NULL, markov_ngram_run, &tasks[t]);
+  }
+  for (size_t t = 0; t < thread_count; ++t) {
+    pthread_join(tasks[t].thread, NULL);
+  }
+  markov_ngram_print(frozen, tasks, thread_count, false);
+  markov_ngram_print(frozen, tasks, thread_count, true);
+  free(tasks);
+}
+
+/**
+ * Trains a model on a training file, or only on the quotes attributed to
+ * author when it is not NULL, and prints its most frequent n-grams, only those
+ * containing word when it is not NULL.
+ *
+ * @return Returns false if the file could not be loaded.
+*/
+bool markov_report_top_ngrams(const char *file_name, const char *word,
+                              const char *author) {
+  MarkovModel *model = author ? markov_model_load_author(file_name, author)
+                              : markov_model_load_file(file_name, NULL, NULL);
+  MarkovFrozen *frozen = markov_model_freeze(model);
+  markov_model_free(model);
+  if (!frozen) { return false; }
+  markov_frozen_report_ngrams(frozen, word, ANALYSIS_THREAD_COUNT);
+  markov_frozen_free(frozen);
+  return true;
+}
+
+/**
+ * Profiles a freshly frozen model, optimizes its layout, prewarms its hot
+ * pages and compresses its successors if configured.
+*/
+void markov_frozen_optimize(MarkovFrozen *frozen) {
+  markov_frozen_profile(frozen, PROFILE_QUOTE_COUNT);
+  size_t hot_count = markov_frozen_optimize_layout(frozen);
+  markov_frozen_prewarm(frozen, hot_count);
+  if (BENCHMARK_QUOTE_COUNT) {
+    markov_frozen_report_latency(frozen, "hotness order", BENCHMARK_QUOTE_COUNT);
+  }
+  markov_frozen_compress(frozen);
+  if (BENCHMARK_QUOTE_COUNT && frozen->pages) {
+    markov_frozen_report_latency(frozen, "compressed pages", BENCHMARK_QUOTE_COUNT);
+    markov_page_store_report(frozen->pages, frozen->successor_count);
+  }
+}
+
+/**
+ * Builds the full MarkovFrozen model for a training file: counts the
+ * vocabulary if word classes or a vocabulary cap are configured, trains and
+ * freezes the model, then profiles it and optimizes its layout. Returns NULL
+ * if the file could not be loaded. The caller is responsible for freeing the
+ * returned model.
+*/
+MarkovFrozen *markov_frozen_build_file(const char *file_name) {
+  MarkovClasses *classes = NULL;
+  MarkovOov *oov = NULL;
+  if (WORD_CLASS_COUNT || VOCAB_MAX_WORDS || VOCAB_MIN_COUNT > 1) {
+    MarkovVocab *vocab = markov_vocab_count_file(file_name);
+    if (!vocab) { return NULL; }
+    if (VOCAB_MAX_WORDS || VOCAB_MIN_COUNT > 1) {
+      oov = markov_oov_new(vocab, VOCAB_MAX_WORDS, VOCAB_MIN_COUNT);
+      vocab = markov_vocab_copy(oov->vocab);
+    }
+    if (WORD_CLASS_COUNT) {
+      classes = markov_classes_new(vocab, WORD_CLASS_COUNT);
+    } else {
+      markov_vocab_free(vocab);
+    }
+  }
+  double start = get_time_seconds();
+  MarkovModel *model = markov_model_load_file(file_name, classes, oov);
+  if (BENCHMARK_QUOTE_COUNT) {
+    fprintf(stderr, "trained in %.2f ms\n", (get_time_seconds() - start) * 1e3);
+  }
+  start = get_time_seconds();
+  MarkovFrozen *frozen = markov_model_freeze(model);
+  if (BENCHMARK_QUOTE_COUNT) {
+    fprintf(stderr, "frozen in %.2f ms\n", (get_time_seconds() - start) * 1e3);
+  }
+  markov_model_free(model);
+  if (!frozen) {
+    markov_classes_free(classes);
+    markov_oov_free(oov);
+    return NULL;
+  }
+  frozen->classes = classes;
+  frozen->oov = oov;
+
+  if (BENCHMARK_QUOTE_COUNT) {
+    markov_frozen_report_score(frozen, file_name);
+    markov_frozen_report_latency(frozen, "hash order", BENCHMARK_QUOTE_COUNT);
+    markov_frozen_report_sampling(frozen, BENCHMARK_QUOTE_COUNT * 1000);
+  }
+  markov_frozen_optimize(frozen);
+  return frozen;
+}
+
+/**
+ * Builds the MarkovFrozen model for a saved model table, adds the quotes of
+ * update_count training files one file at a time by patching the frozen model
+ * with the changed contexts, then profiles it and optimizes its layout.
+ * Returns NULL if the table or a training file could not be read. The caller
+ * is responsible for freeing the returned model.
+*/
+MarkovFrozen *markov_frozen_build_table(const char *file_name, char **update_names,
+                                        size_t update_count) {
+  MarkovModel *model = markov_model_load_table(file_name);
+  MarkovFrozen *frozen = markov_model_freeze(model);
+  if (!frozen) { return NULL; }
+  model->track_dirty = true;
+  for (size_t i = 0; i < update_count; ++i) {
+    if (!markov_model_add_file(model, update_names[i])) {
+      markov_model_free(model);
+      markov_frozen_free(frozen);
+      return NULL;
+    }
+    double start = get_time_seconds();
+    size_t dirty_count = model->dirty_count;
+    markov_frozen_refreeze(frozen, model);
+    if (BENCHMARK_QUOTE_COUNT) {
+      fprintf(stderr, "patched %zu of %zu contexts from %s in %.2f ms\n", dirty_count,
+              frozen->context_count, update_names[i],
+              (get_time_seconds() - start) * 1e3);
+    }
+  }
+  markov_model_free(model);
+  markov_frozen_optimize(frozen);
+  return frozen;
+}
+
+/**
+ * A batch of quotes held as word ids: the words of quote i are
+ * tokens[offsets[i]] up to tokens[offsets[i + 1]]. Vocab maps the ids back to
+ * words.
+*/
+typedef struct MarkovQuoteBatch {
+  MarkovVocab *vocab;
+  size_t quote_count;
+  size_t quote_capacity;
+  size_t *offsets;
+  size_t token_count;
+  size_t token_capacity;
+  uint32_t *tokens;
+} MarkovQuoteBatch;
+
+/**
+ * Returns a new, empty MarkovQuoteBatch whose ids refer to vocab, which the
+ * batch does not own. The caller is responsible for freeing the batch with
+ * markov_quote_batch_free().
+*/
+MarkovQuoteBatch *markov_quote_batch_new(MarkovVocab *vocab) {
+  MarkovQuoteBatch *batch = calloc(1, sizeof(MarkovQuoteBatch));
+  batch->vocab = vocab;
+  batch->quote_capacity = 64;
+  batch->offsets = calloc(batch->quote_capacity + 1, sizeof(size_t));
+  batch->token_capacity = 1024;
+  batch->tokens = malloc(batch->token_capacity * sizeof(uint32_t));
+  return batch;
+}
+
+/**
+ * Appends a word id to the last quote of a MarkovQuoteBatch.
+*/
+void markov_quote_batch_add_token(MarkovQuoteBatch *batch, uint32_t id) {
+  if (batch->token_count == batch->token_capacity) {
+    batch->token_capacity *= 2;
+    batch->tokens = realloc(batch->tokens, batch->token_capacity * sizeof(uint32_t));
+  }
+  batch->tokens[batch->token_count++] = id;
+}
+
+/**
+ * Ends the last quote of a MarkovQuoteBatch, unless it is empty.
+*/
+void markov_quote_batch_end_quote(MarkovQuoteBatch *batch) {
+  if (batch->token_count == batch->offsets[batch->quote_count]) { return; }
+  if (batch->quote_count == batch->quote_capacity) {
+    batch->quote_capacity *= 2;
+    batch->offsets = realloc(batch->offsets,
+                             (batch->quote_capacity + 1) * sizeof(size_t));
+  }
+  batch->offsets[++batch->quote_count] = batch->token_count;
+}
+
+/**
+ * A MarkovTokenHandler that appends each generated word to a
+ * MarkovQuoteBatch.
+*/
+bool markov_quote_batch_token(void *state, uint32_t id, const char *word,
+                              size_t length) {
+  (void)word;
+  (void)length;
+  markov_quote_batch_add_token(state, id);
+  return true;
+}
+
+/**
+ * A MarkovWordHandler that reads the quotes of a file into a
+ * MarkovQuoteBatch, interning words into its vocabulary.
+*/
+void markov_quote_batch_word(void *state, char *word) {
+  MarkovQuoteBatch *batch = state;
+  if (!word) {
+    markov_quote_batch_end_quote(batch);
+    return;
+  }
+  markov_quote_batch_add_token(batch, markov_vocab_intern(batch->vocab, word));
+}
+
+/**
+ * Frees all the data associated with a MarkovQuoteBatch, except its
+ * vocabulary.
+*/
+void markov_quote_batch_free(MarkovQuoteBatch *batch) {
+  if (!batch) { return; }
+  free(batch->offsets);
+  free(batch->tokens);
+  free(batch);
+}
+
+/**
+ * A concurrent multiset of n-grams, keyed by a 64-bit hash of their word ids
+ * and never zero, with open addressing. Threads claim empty slots with a
+ * compare and swap and count with atomic adds, so no lock is taken. Two
+ * n-grams whose hashes collide are counted as one, which at 64 bits does not
+ * move the metrics. Size counts the distinct n-grams.
+*/
+typedef struct MarkovNgramSet {
+  size_t slot_count;
+  _Atomic uint64_t *keys;
+  _Atomic uint32_t *counts;
+  _Atomic size_t size;
+} MarkovNgramSet;
+
+/**
+ * Returns a new MarkovNgramSet able to hold capacity n-grams at under half
+ * load. The caller is responsible for freeing it with markov_ngram_set_free().
+*/
+MarkovNgramSet *markov_ngram_set_new(size_t capacity) {
+  MarkovNgramSet *set = calloc(1, sizeof(MarkovNgramSet));
+  set->slot_count = 16;
+  while (set->slot_count < 2 * capacity) {
+    set->slot_count *= 2;
+  }
+  set->keys = calloc(set->slot_count, sizeof(_Atomic uint64_t));
+  set->counts = calloc(set->slot_count, sizeof(_Atomic uint32_t));
+  return set;
+}
+
+/**
+ * Returns the slot of an n-gram hash in a MarkovNgramSet, claiming an empty
+ * slot for it if it is not present and claim is true, or SIZE_MAX if it is
+ * not present and claim is false.
+*/
+size_t markov_ngram_set_find(MarkovNgramSet *set, uint64_t hash, bool claim) {
+  size_t mask = set->slot_count - 1;
+  for (size_t slot = hash & mask;; slot = (slot + 1) & mask) {
+    uint64_t key = atomic_load_explicit(&set->keys[slot], memory_order_relaxed);
+    if (key == 0) {
+      if (!claim) { return SIZE_MAX; }
+      if (atomic_compare_exchange_strong_explicit(&set->keys[slot], &key, hash,
+                                                  memory_order_relaxed,
+                                                  memory_order_relaxed)) {
+        atomic_fetch_add_explicit(&set->size, 1, memory_order_relaxed);
+        return slot;
+      }
+    }
+    if (key == hash) { return slot; }
+  }
+}
+
+/**
+ * Counts one occurrence of an n-gram hash in a MarkovNgramSet.
+*/
+void markov_ngram_set_add(MarkovNgramSet *set, uint64_t hash) {
+  size_t slot = markov_ngram_set_find(set, hash, true);
+  atomic_fetch_add_explicit(&set->counts[slot], 1, memory_order_relaxed);
+}
+
+/**
+ * Returns the number of occurrences of an n-gram hash in a MarkovNgramSet.
+*/
+uint32_t markov_ngram_set_count(MarkovNgramSet *set, uint64_t hash) {
+  size_t slot = markov_ngram_set_find(set, hash, false);
+  if (slot == SIZE_MAX) { return 0; }
+  return atomic_load_explicit(&set->counts[slot], memory_order_relaxed);
+}
+
+/**
+ * Frees all the data associated with a MarkovNgramSet.
+*/
+void markov_ngram_set_free(MarkovNgramSet *set) {
+  if (!set) { return; }
+  free(set->keys);
+  free(set->counts);
+  free(set);
+}
+
+/**
+ * Returns the hash of the n word ids starting at tokens, which is never zero.
+*/
+uint64_t markov_ngram_get_hash(const uint32_t *tokens, size_t n) {
+  uint64_t hash = n;
+  for (size_t i = 0; i < n; ++i) {
+    hash = (hash ^ tokens[i]) * 0x9e3779b97f4a7c15ULL;
+    hash ^= hash >> 29;
+  }
+  return hash ? hash : 1;
+}
+
+/**
+ * One thread's share of the diversity metrics of a MarkovQuoteBatch: the
+ * quotes [first, last). Sets holds one MarkovNgramSet for each n from 1 to
+ * METRICS_MAX_N, then one for whole quotes. The counting pass adds every
+ * n-gram to the shared sets; the repeat pass counts the n-grams of the range
+ * that occur more than once in the whole batch.
+*/
+typedef struct MarkovMetricsTask {
+  const MarkovQuoteBatch *batch;
+  MarkovNgramSet **sets;
+  size_t first;
+  size_t last;
+  bool counting;
+  size_t totals[METRICS_MAX_N + 1];
+  size_t repeats[METRICS_MAX_N + 1];
+  pthread_t thread;
+} MarkovMetricsTask;
+
+/**
+ * The body of a metrics thread. Runs the counting or the repeat pass over its
+ * quotes.
+*/
+void *markov_metrics_run(void *state) {
+  MarkovMetricsTask *task = state;
+  const MarkovQuoteBatch *batch = task->batch;
+  for (size_t q = task->first; q < task->last; ++q) {
+    const uint32_t *tokens = batch->tokens + batch->offsets[q];
+    size_t length = batch->offsets[q + 1] - batch->offsets[q];
+    for (size_t n = 1; n <= METRICS_MAX_N + 1; ++n) {
+      /** The last set holds whole quotes */
+      size_t gram = n <= METRICS_MAX_N ? n : length;
+      for (size_t i = 0; i + gram <= length; ++i) {
+        uint64_t hash = markov_ngram_get_hash(tokens + i, gram);
+        if (task->counting) {
+          markov_ngram_set_add(task->sets[n - 1], hash);
+        } else {
+          task->totals[n - 1]++;
+          task->repeats[n - 1] += markov_ngram_set_count(task->sets[n - 1], hash) > 1;
+        }
+      }
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Runs one pass of the diversity metrics over a MarkovQuoteBatch on
+ * thread_count threads, splitting the quotes evenly between them.
+*/
+void markov_metrics_run_pass(MarkovMetricsTask *tasks, size_t thread_count,
+                             bool counting) {
+  for (size_t t = 0; t < thread_count; ++t) {
+    tasks[t].counting = counting;
+    pthread_create(&tasks[t].thread, NULL, markov_metrics_run, &tasks[t]);
+  }
+  for (size_t t = 0; t < thread_count; ++t) {
+    pthread_join(tasks[t].thread, NULL);
+  }
+}
+
+/**
+ * Prints diversity metrics of a MarkovQuoteBatch computed on thread_count
+ * threads: for each n up to METRICS_MAX_N, distinct-n (distinct n-grams over
+ * all n-grams) and the repeat rate (the share of n-grams that occur more than
+ * once in the batch, a self-BLEU style overlap), then the same for whole
+ * quotes.
+*/
+void markov_quote_batch_report_metrics(const MarkovQuoteBatch *batch,
+                                       size_t thread_count) {
+  MarkovNgramSet *sets[METRICS_MAX_N + 1];
+  for (size_t n = 0; n <= METRICS_MAX_N; ++n) {
+    sets[n] = markov_ngram_set_new(batch->token_count);
+  }
+  MarkovMetricsTask *tasks = calloc(thread_count, sizeof(MarkovMetricsTask));
+  for (size_t t = 0; t < thread_count; ++t) {
+    tasks[t].batch = batch;
+    tasks[t].sets = sets;
+    tasks[t].first = batch->quote_count * t / thread_count;
+    tasks[t].last = batch->quote_count * (t + 1) / thread_count;
+  }
+  double start = get_time_seconds();
+  markov_metrics_run_pass(tasks, thread_count, true);
+  markov_metrics_run_pass(tasks, thread_count, false);
+  printf("%zu quotes, %zu words, measured in %.2f ms\n", batch->quote_count,
+         batch->token_count, (get_time_seconds() - start) * 1e3);
+  for (size_t n = 0; n <= METRICS_MAX_N; ++n) {
+    size_t total = 0;
+    size_t repeats = 0;
+    for (size_t t = 0; t < thread_count; ++t) {
+      total += tasks[t].totals[n];
+      repeats += tasks[t].repeats[n];
+    }
+    size_t distinct = atomic_load(&sets[n]->size);
+    if (n < METRICS_MAX_N) {
+      printf("distinct-%zu %.4f, repeat rate %.4f\n", n + 1,
+             total ? (double)distinct / total : 0.0,
+             total ? (double)repeats / total : 0.0);
+    } else {
+      printf("unique quotes %.4f, repeated quotes %.4f\n",
+             total ? (double)distinct / total : 0.0,
+             total ? (double)repeats / total : 0.0);
+    }
+    markov_ngram_set_free(sets[n]);
+  }
+  free(tasks);
+}
+
+/**
+ * Prints the diversity metrics of the quotes of a file or, when file_name is
+ * NULL, of METRICS_QUOTE_COUNT quotes generated from the model trained on
+ * FILE_NAME.
+ *
+ * @return Returns false if a file could not be loaded.
+*/
+bool markov_report_metrics(const char *file_name) {
+  MarkovFrozen *frozen = NULL;
+  MarkovVocab *vocab = NULL;
+  MarkovQuoteBatch *batch;
+  if (file_name) {
+    vocab = markov_vocab_new();
+    batch = markov_quote_batch_new(vocab);
+    if (!markov_file_for_each_word(file_name, markov_quote_batch_word, batch)) {
+      markov_quote_batch_free(batch);
+      markov_vocab_free(vocab);
+      return false;
+    }
+  } else {
+    frozen = markov_frozen_build_file(FILE_NAME);
+    if (!frozen) { return false; }
+    batch = markov_quote_batch_new(frozen->vocab);
+    double start = get_time_seconds();
+    for (size_t i = 0; i < METRICS_QUOTE_COUNT; ++i) {
+      markov_frozen_stream_words(frozen, NULL, NULL, markov_quote_batch_token, batch);
+      markov_quote_batch_end_quote(batch);
+    }
+    printf("generated in %.2f ms\n", (get_time_seconds() - start) * 1e3);
+  }
+  markov_quote_batch_report_metrics(batch, ANALYSIS_THREAD_COUNT);
+  markov_quote_batch_free(batch);
+  markov_vocab_free(vocab);
+  markov_frozen_free(frozen);
+  return true;
+}
+
+/**
+ * A fixed-size uniform sample of the quotes of a training file, taken in one
+ * streaming pass with reservoir sampling. Quote holds the words of the quote
+ * currently being read, joined by spaces.
+*/
+typedef struct MarkovQuoteSample {
+  size_t capacity;
+  size_t count;
+  size_t seen;
+  char **quotes;
+  char *quote;
+} MarkovQuoteSample;
+
+/**
+ * A MarkovWordHandler that collects the words of each quote and, at the end
+ * of the quote, adds it to the reservoir of a MarkovQuoteSample.
+*/
+void markov_quote_sample_word(void *state, char *word) {
+  MarkovQuoteSample *sample = state;
+  if (word) {
+    sample->quote = add_word_to_quote(sample->quote, word);
+    return;
+  }
+  if (sample->quote[0] == '\0') { return; }
+  size_t slot = sample->seen++;
+  if (slot >= sample->capacity) {
+    slot = markov_random_next() % sample->seen;
+  }
+  if (slot < sample->capacity) {
+    if (slot < sample->count) {
+      free(sample->quotes[slot]);
+    } else {
+      sample->count++;
+    }
+    sample->quotes[slot] = sample->quote;
+  } else {
+    free(sample->quote);
+  }
+  sample->quote = calloc(1, 1);
+}
+
+/**
+ * Trains a MarkovFrozen model over a reservoir sample of quote_count quotes
+ * from a training file. The sample is taken in a single pass, so the time to
+ * build the preview depends on the sample size rather than the corpus size,
+ * apart from reading the file. Returns NULL if the file could not be read.
+ * The caller is responsible for freeing the returned model.
+*/
+MarkovFrozen *markov_frozen_build_preview(const char *file_name, size_t quote_count) {
+  MarkovQuoteSample sample = {
+    .capacity = quote_count,
+    .quotes = malloc(quote_count * sizeof(char *)),
+    .quote = calloc(1, 1)
+  };
+  bool loaded = markov_file_for_each_word(file_name, markov_quote_sample_word, &sample);
+  free(sample.quote);
+
+  MarkovModel *model = markov_model_new(HASH_MAP_SIZE);
+  MarkovLoadState load = { model, markov_insert_batch_new(model), NULL, NULL };
+  for (size_t i = 0; i < sample.count; ++i) {
+    char *save;
+    for (char *word = strtok_r(sample.quotes[i], " ", &save); word;
+         word = strtok_r(NULL, " ", &save)) {
+      markov_model_load_word(&load, word);
+    }
+    markov_model_load_word(&load, NULL);
+    free(sample.quotes[i]);
+  }
+  free(sample.quotes);
+  markov_insert_batch_free(load.batch);
+
+  MarkovFrozen *frozen = loaded ? markov_model_freeze(load.model) : NULL;
+  markov_model_free(load.model);
+  return frozen;
+}
+
+/**
+ * A MarkovFrozen model that is being served while a better model is built in
+ * the background. The background thread publishes the finished model in
+ * pending, and the serving thread swaps it in the next time it asks for the
+ * current model, so only the serving thread ever frees a model. Synchronous
+ * is set if the background thread could not be started and the full model
+ * was built up front instead.
+*/
+typedef struct MarkovLive {
+  MarkovFrozen *current;
+  _Atomic(MarkovFrozen *) pending;
+  const char *file_name;
+  pthread_t thread;
+  bool synchronous;
+  double start;
+} MarkovLive;
+
+/**
+ * The background thread of a MarkovLive instance. Builds the full model and
+ * publishes it.
+*/
+void *markov_live_build(void *state) {
+  MarkovLive *live = state;
+  MarkovFrozen *frozen = markov_frozen_build_file(live->file_name);
+  if (BENCHMARK_QUOTE_COUNT) {
+    fprintf(stderr, "full model ready after %.2f ms\n",
+            (get_time_seconds() - live->start) * 1e3);
+  }
+  atomic_store(&live->pending, frozen);
+  return NULL;
+}
+
+/**
+ * Builds a preview model from a sample of preview_quote_count quotes and
+ * starts building the full model in the background. Returns NULL if the
+ * preview could not be built. If the background thread cannot be started,
+ * the full model is built before returning. The caller is responsible for freeing the
+ * returned instance with markov_live_free().
+*/
+MarkovLive *markov_live_start(const char *file_name, size_t preview_quote_count) {
+  MarkovLive *live = calloc(1, sizeof(MarkovLive));
+  live->file_name = file_name;
+  live->start = get_time_seconds();
+  live->current = markov_frozen_build_preview(file_name, preview_quote_count);
+  if (!live->current) {
+    free(live);
+    return NULL;
+  }
+  if (BENCHMARK_QUOTE_COUNT) {
+    fprintf(stderr, "preview model ready after %.2f ms\n",
+            (get_time_seconds() - live->start) * 1e3);
+  }
+  atomic_init(&live->pending, NULL);
+  if (pthread_create(&live->thread, NULL, markov_live_build, live) != 0) {
+    live->synchronous = true;
+    markov_live_build(live);
+  }
+  return live;
+}
+
+/**
+ * Returns the model to serve from, swapping in the full model and freeing the
+ * preview if the background build has finished.
+*/
+MarkovFrozen *markov_live_get(MarkovLive *live) {
+  MarkovFrozen *pending = atomic_exchange(&live->pending, NULL);
+  if (pending) {
+    markov_frozen_free(live->current);
+    live->current = pending;
+  }
+  return live->current;
+}
+
+/**
+ * Waits for the background build of a MarkovLive instance to finish and frees
+ * all the data associated with it.
+*/
+void markov_live_free(MarkovLive *live) {
+  if (!live) { return; }
+  if (!live->synchronous) {
+    pthread_join(live->thread, NULL);
+  }
+  markov_frozen_free(markov_live_get(live));
+  free(live);
+}
+
+/**
+ * A request to the quote server: quote_count quotes of at most max_length
+ * words each, sampled from a generator seeded with seed.
+*/
+typedef struct MarkovRequest {
+  size_t quote_count;
+  size_t max_length;
+  uint64_t seed;
+} MarkovRequest;
+
+/**
+ * The response to a MarkovRequest: the quotes as newline separated text, and
+ * the number of words generated. Quote_words counts the words of the quote
+ * being generated.
+*/
+typedef struct MarkovResponse {
+  size_t length;
+  size_t capacity;
+  char *text;
+  size_t words;
+  size_t quote_words;
+  size_t max_length;
+} MarkovResponse;
+
+/**
+ * Appends data to the text of a MarkovResponse, growing it as needed.
+*/
+void markov_response_append(MarkovResponse *response, const char *data, size_t length) {
+  if (response->length + length > response->capacity) {
+    response->capacity = (response->length + length) * 2;
+    response->text = realloc(response->text, response->capacity);
+  }
+  memcpy(response->text + response->length, data, length);
+  response->length += length;
+}
+
+/**
+ * A MarkovTokenHandler that appends each word to a MarkovResponse and stops
+ * the quote once it has max_length words.
+*/
+bool markov_response_token(void *state, uint32_t id, const char *word, size_t length) {
+  (void)id;
+  MarkovResponse *response = state;
+  if (response->quote_words == response->max_length) { return false; }
+  if (response->quote_words > 0) {
+    markov_response_append(response, " ", 1);
+  }
+  markov_response_append(response, word, length);
+  response->quote_words++;
+  response->words++;
+  return true;
+}
+
+/**
+ * Serves a MarkovRequest from a MarkovFrozen model into response, replacing
+ * its previous text. Seeds the generator of the calling thread, so a request
+ * gets the same quotes from any thread. Returns the number of words generated.
+*/
+size_t markov_frozen_serve(MarkovFrozen *frozen, const MarkovMask *mask,
+                           const MarkovRequest *request, MarkovResponse *response) {
+  markov_random_seed(request->seed);
+  response->length = 0;
+  response->words = 0;
+  response->max_length = request->max_length;
+  for (size_t i = 0; i < request->quote_count; ++i) {
+    response->quote_words = 0;
+    markov_frozen_stream_words(frozen, mask, NULL, markov_response_token, response);
+    markov_response_append(response, "\n", 1);
+  }
+  return response->words;
+}
+
+/**
+ * Parses a request mix of space separated <quotes>:<max words> entries into a
+ * new array of MarkovRequests and sets count to its length. Malformed entries
+ * are skipped. The caller is responsible for freeing the array.
+*/
+MarkovRequest *markov_request_mix_parse(const char *mix, size_t *count) {
+  char *entries = strdup(mix);
+  MarkovRequest *requests = malloc((strlen(mix) / 2 + 1) * sizeof(MarkovRequest));
+  *count = 0;
+  char *save;
+  for (char *entry = strtok_r(entries, " ", &save); entry;
+       entry = strtok_r(NULL, " ", &save)) {
+    MarkovRequest *request = &requests[*count];
+    if (sscanf(entry, "%zu:%zu", &request->quote_count, &request->max_length) == 2
+        && request->max_length > 0) {
+      request->seed = 0;
+      (*count)++;
+    }
+  }
+  free(entries);
+  return requests;
+}
+
+/**
+ * How an admitted request is answered under overload: generated in full,
+ * generated with at most OVERLOAD_SHORT_LENGTH words per quote, copied from
+ * the pre-generated pool, or rejected.
+*/
+typedef enum MarkovAdmission {
+  MARKOV_ADMIT_SERVE,
+  MARKOV_ADMIT_SHORTEN,
+  MARKOV_ADMIT_POOL,
+  MARKOV_ADMIT_REJECT
+} MarkovAdmission;
+
+/**
+ * The overload control of the serving path. The queue delay of each request
+ * (the time between its arrival and the moment a worker takes it) drives a
+ * CoDel controller: once the delay has stayed above OVERLOAD_TARGET_MS for
+ * OVERLOAD_INTERVAL_MS the controller enters its dropping state, in which
+ * requests are shortened and, at the rate of the CoDel control law, answered
+ * from a pool of pre-generated quotes. Quote_seconds is a moving average of
+ * the cost of generating one quote, used to reject requests that cannot
+ * finish within OVERLOAD_DEADLINE_MS of their arrival.
+*/
+typedef struct MarkovOverload {
+  pthread_mutex_t lock;
+  double first_above;
+  double drop_next;
+  size_t drop_count;
+  bool dropping;
+  double quote_seconds;
+  size_t pool_size;
+  char **pool;
+  _Atomic size_t pool_next;
+} MarkovOverload;
+
+/**
+ * Returns a new MarkovOverload with a pool of OVERLOAD_POOL_SIZE quotes
+ * served from a MarkovFrozen model like any other request, never sampling a
+ * word in mask and capped at OVERLOAD_SHORT_LENGTH words, so a pooled answer
+ * is never longer than a shortened one. The caller is responsible for freeing
+ * it with markov_overload_free().
+*/
+MarkovOverload *markov_overload_new(MarkovFrozen *frozen, const MarkovMask *mask) {
+  MarkovOverload *overload = calloc(1, sizeof(MarkovOverload));
+  pthread_mutex_init(&overload->lock, NULL);
+  overload->pool_size = OVERLOAD_POOL_SIZE;
+  overload->pool = malloc(overload->pool_size * sizeof(char *));
+  MarkovResponse response = { 0 };
+  for (size_t i = 0; i < overload->pool_size; ++i) {
+    MarkovRequest request = { 1, OVERLOAD_SHORT_LENGTH, LOAD_SEED + i };
+    markov_frozen_serve(frozen, mask, &request, &response);
+    /** Drop the newline ending the quote; it is added back when serving */
+    overload->pool[i] = strndup(response.text, response.length - 1);
+  }
+  free(response.text);
+  atomic_init(&overload->pool_next, 0);
+  return overload;
+}
+
+/**
+ * The CoDel dequeue decision for a request that waited sojourn seconds: true
+ * if it should be dropped. Must be called with the lock held.
+*/
+bool markov_overload_should_drop(MarkovOverload *overload, double now, double sojourn) {
+  double target = OVERLOAD_TARGET_MS / 1e3;
+  double interval = OVERLOAD_INTERVAL_MS / 1e3;
+  bool above = false;
+  if (sojourn < target) {
+    overload->first_above = 0;
+  } else if (overload->first_above == 0) {
+    overload->first_above = now + interval;
+  } else if (now >= overload->first_above) {
+    above = true;
+  }
+  if (overload->dropping) {
+    if (!above) {
+      overload->dropping = false;
+      return false;
+    }
+    if (now < overload->drop_next) { return false; }
+    overload->drop_count++;
+    overload->drop_next += interval / sqrt(overload->drop_count);
+    return true;
+  }
+  if (!above) { return false; }
+  /** Resume near the previous drop rate if the last episode ended recently */
+  overload->dropping = true;
+  bool recent = now - overload->drop_next < 8 * interval;
+  size_t count = overload->drop_count;
+  overload->drop_count = count > 2 && recent ? count - 2 : 1;
+  overload->drop_next = now + interval / sqrt(overload->drop_count);
+  return true;
+}
+
+/**
+ * Decides how to answer a request that arrived sojourn seconds ago. Requests
+ * expected to miss their deadline are rejected; while the queue delay is
+ * above target, requests are shortened, and those CoDel drops are answered
+ * from the pool.
+*/
+MarkovAdmission markov_overload_admit(MarkovOverload *overload,
+                                      const MarkovRequest *request, double now,
+                                      double sojourn) {
+  pthread_mutex_lock(&overload->lock);
+  bool drop = markov_overload_should_drop(overload, now, sojourn);
+  bool dropping = overload->dropping;
+  double cost = overload->quote_seconds * request->quote_count;
+  pthread_mutex_unlock(&overload->lock);
+  if (sojourn + cost > OVERLOAD_DEADLINE_MS / 1e3) { return MARKOV_ADMIT_REJECT; }
+  if (drop) { return MARKOV_ADMIT_POOL; }
+  if (dropping) { return MARKOV_ADMIT_SHORTEN; }
+  return MARKOV_ADMIT_SERVE;
+}
+
+/**
+ * Adds the cost of a generated request to the moving average cost of a quote.
+*/
+void markov_overload_record_cost(MarkovOverload *overload, const MarkovRequest *request,
+                                 double seconds) {
+  if (request->quote_count == 0) { return; }
+  pthread_mutex_lock(&overload->lock);
+  double quote_seconds = seconds / request->quote_count;
+  overload->quote_seconds += (quote_seconds - overload->quote_seconds) / 8;
+  pthread_mutex_unlock(&overload->lock);
+}
+
+/**
+ * Answers a request with quotes from the pool of a MarkovOverload, replacing
+ * the previous text of response.
+*/
+void markov_overload_serve_pool(MarkovOverload *overload, const MarkovRequest *request,
+                                MarkovResponse *response) {
+  response->length = 0;
+  response->words = 0;
+  for (size_t i = 0; i < request->quote_count; ++i) {
+    size_t next = atomic_fetch_add(&overload->pool_next, 1);
+    char *quote = overload->pool[next % overload->pool_size];
+    markov_response_append(response, quote, strlen(quote));
+    markov_response_append(response, "\n", 1);
+  }
+}
+
+/**
+ * Frees all the data associated with a MarkovOverload.
+*/
+void markov_overload_free(MarkovOverload *overload) {
+  if (!overload) { return; }
+  for (size_t i = 0; i < overload->pool_size; ++i) {
+    free(overload->pool[i]);
+  }
+  free(overload->pool);
+  pthread_mutex_destroy(&overload->lock);
+  free(overload);
+}
+
+/**
+ * The shared state of a load test. Request i uses entry i of the request mix,
+ * wrapping around, with seed LOAD_SEED + i. In open loop, request i is
+ * scheduled at start + i / rate whether or not earlier requests have finished;
+ * in closed loop, each worker is a client sending its next request as soon as
+ * the previous one is answered. Next is the number of the next request.
+ * Overload, when set, controls the admission of open loop requests.
+*/
+typedef struct MarkovLoadTest {
+  MarkovFrozen *frozen;
+  const MarkovMask *mask;
+  MarkovOverload *overload;
+  const MarkovRequest *mix;
+  size_t mix_count;
+  bool open_loop;
+  double rate;
+  double start;
+  double duration;
+  _Atomic size_t next;
+} MarkovLoadTest;
+
+/**
+ * A worker of a load test, with the latencies of the requests it answered,
+ * the words it generated, and how many requests it answered in each way.
+*/
+typedef struct MarkovLoadWorker {
+  MarkovLoadTest *test;
+  MarkovLatencyHistogram latency;
+  size_t requests;
+  size_t words;
+  size_t admissions[MARKOV_ADMIT_REJECT + 1];
+  pthread_t thread;
+} MarkovLoadWorker;
+
+/**
+ * Waits until the given time, in seconds of get_time_seconds().
+*/
+void markov_sleep_until(double time) {
+  double delay = time - get_time_seconds();
+  if (delay <= 0) { return; }
+  struct timespec wait = { (time_t)delay, (long)((delay - (time_t)delay) * 1e9) };
+  nanosleep(&wait, NULL);
+}
+
+/**
+ * The body of a load test worker. Latencies are measured from the time each
+ * request was scheduled to start, not from when it was sent, so requests that
+ * wait behind a slow one are charged for the wait (coordinated omission is
+ * corrected). In closed loop the two times are the same. The time a request
+ * waited before a worker took it is its queue delay, used for admission.
+ * Rejected requests are not part of the latencies.
+*/
+void *markov_load_worker_run(void *state) {
+  MarkovLoadWorker *worker = state;
+  MarkovLoadTest *test = worker->test;
+  MarkovResponse response = {0};
+  while (true) {
+    size_t number = atomic_fetch_add(&test->next, 1);
+    double scheduled =
+        test->open_loop ? test->start + number / test->rate : get_time_seconds();
+    if (scheduled >= test->start + test->duration) { break; }
+    markov_sleep_until(scheduled);
+    MarkovRequest request = test->mix[number % test->mix_count];
+    request.seed = LOAD_SEED + number;
+    MarkovAdmission admission = MARKOV_ADMIT_SERVE;
+    double taken = get_time_seconds();
+    if (test->overload) {
+      admission = markov_overload_admit(test->overload, &request, taken,
+                                        taken - scheduled);
+    }
+    worker->admissions[admission]++;
+    if (admission == MARKOV_ADMIT_REJECT) { continue; }
+    if (admission == MARKOV_ADMIT_POOL) {
+      markov_overload_serve_pool(test->overload, &request, &response);
+    } else {
+      if (admission == MARKOV_ADMIT_SHORTEN
+          && request.max_length > OVERLOAD_SHORT_LENGTH) {
+        request.max_length = OVERLOAD_SHORT_LENGTH;
+      }
+      worker->words += markov_frozen_serve(test->frozen, test->mask, &request,
+                                           &response);
+      if (test->overload) {
+        markov_overload_record_cost(test->overload, &request,
+                                    get_time_seconds() - taken);
+      }
+    }
+    worker->requests++;
+    markov_histogram_record(&worker->latency,
+                            (uint64_t)((get_time_seconds() - scheduled) * 1e9));
+  }
+  free(response.text);
+  return NULL;
+}
+
+/**
+ * Drives a MarkovFrozen model with LOAD_SECONDS of requests from the
+ * LOAD_REQUEST_MIX, either in open loop at rate requests per second served by
+ * LOAD_THREAD_COUNT threads, or in closed loop with rate concurrent clients,
+ * then prints the throughput and the latency percentiles. Open loop requests
+ * go through overload control unless OVERLOAD_TARGET_MS is 0, and the number
+ * of requests answered in each way is printed too.
+*/
+void markov_frozen_report_load(MarkovFrozen *frozen, const MarkovMask *mask,
+                               bool open_loop, double rate) {
+  MarkovLoadTest test;
+  test.frozen = frozen;
+  test.mask = mask;
+  MarkovRequest *mix = markov_request_mix_parse(LOAD_REQUEST_MIX, &test.mix_count);
+  test.mix = mix;
+  test.open_loop = open_loop;
+  test.rate = rate;
+  test.duration = LOAD_SECONDS;
+  atomic_init(&test.next, 0);
+  if (test.mix_count == 0) {
+    fprintf(stderr, "LOAD_REQUEST_MIX has no valid entries\n");
+    free(mix);
+    return;
+  }
+  bool degrade = open_loop && OVERLOAD_TARGET_MS;
+  test.overload = degrade ? markov_overload_new(frozen, mask) : NULL;
+
+  size_t worker_count = open_loop ? LOAD_THREAD_COUNT : (size_t)rate;
+  MarkovLoadWorker *workers = calloc(worker_count, sizeof(MarkovLoadWorker));
+  test.start = get_time_seconds();
+  for (size_t i = 0; i < worker_count; ++i) {
+    workers[i].test = &test;
+    pthread_create(&workers[i].thread, NULL, markov_load_worker_run, &workers[i]);
+  }
+  MarkovLatencyHistogram latency = {0};
+  size_t requests = 0;
+  size_t words = 0;
+  size_t admissions[MARKOV_ADMIT_REJECT + 1] = {0};
+  for (size_t i = 0; i < worker_count; ++i) {
+    pthread_join(workers[i].thread, NULL);
+    markov_histogram_merge(&latency, &workers[i].latency);
+    requests += workers[i].requests;
+    words += workers[i].words;
+    for (size_t j = 0; j <= MARKOV_ADMIT_REJECT; ++j) {
+      admissions[j] += workers[i].admissions[j];
+    }
+  }
+  double elapsed = get_time_seconds() - test.start;
+
+  if (open_loop) {
+    printf("open loop at %.0f requests/s on %zu threads\n", rate, worker_count);
+  } else {
+    printf("closed loop with %zu clients\n", worker_count);
+  }
+  printf("%zu requests in %.2f s: %.0f requests/s, %.0f words/s\n", requests, elapsed,
+         requests / elapsed, words / elapsed);
+  double percentiles[] = { 50, 90, 99, 99.9, 100 };
+  printf("latency:");
+  for (size_t i = 0; i < sizeof(percentiles) / sizeof(percentiles[0]); ++i) {
+    printf(" p%g %.1f us", percentiles[i],
+           markov_histogram_percentile(&latency, percentiles[i]) / 1e3);
+  }
+  printf("\n");
+  if (test.overload) {
+    printf("served %zu in full, %zu shortened, %zu from the pool, %zu rejected\n",
+           admissions[MARKOV_ADMIT_SERVE], admissions[MARKOV_ADMIT_SHORTEN],
+           admissions[MARKOV_ADMIT_POOL], admissions[MARKOV_ADMIT_REJECT]);
+  }
+  markov_overload_free(test.overload);
+  free(workers);
+  free(mix);
+}
+
+/**
+ * The point at which a MarkovSession resumes: sampling the next word, writing
+ * the sampled word, or ending the current quote.
+*/
+typedef enum MarkovSessionPoint {
+  MARKOV_SESSION_SAMPLE,
+  MARKOV_SESSION_WRITE,
+  MARKOV_SESSION_END_QUOTE
+} MarkovSessionPoint;
+
+/**
+ * What a MarkovSession needs after it yields: to be scheduled again, to wait
+ * until its buffer is drained, or nothing because it is done.
+*/
+typedef enum MarkovSessionStatus {
+  MARKOV_SESSION_READY,
+  MARKOV_SESSION_BLOCKED,
+  MARKOV_SESSION_DONE
+} MarkovSessionStatus;
+
+/**
+ * A streaming generation session written as a stackless coroutine: everything
+ * it needs to resume lives in the struct, so any worker can run the next step
+ * and an idle session costs only its struct. Words go to buffer, standing in
+ * for the socket buffer of the client. Blocked is set by the worker when the
+ * buffer is full, and cleared by the network once it has drained the buffer;
+ * only the side that sees it in its state touches the buffer. Random is the
+ * state of the sampling generator of the session.
+*/
+typedef struct MarkovSession {
+  MarkovSessionPoint point;
+  uint32_t words[MARKOV_CONTEXT_SIZE];
+  size_t length;
+  char *word;
+  bool last_word;
+  size_t quotes_left;
+  uint64_t random;
+  _Atomic bool blocked;
+  size_t stalls;
+  size_t word_count;
+  size_t delivered;
+  double finish;
+  size_t buffer_length;
+  char buffer[SESSION_BUFFER_SIZE];
+} MarkovSession;
+
+/**
+ * Prepares a MarkovSession to stream quote_count quotes sampled from seed,
+ * leaving the random state of the calling thread as it was.
+*/
+void markov_session_init(MarkovSession *session, size_t quote_count, uint64_t seed) {
+  memset(session, 0, sizeof(MarkovSession));
+  for (size_t i = 0; i < MARKOV_CONTEXT_SIZE; ++i) {
+    session->words[i] = MARKOV_NO_WORD;
+  }
+  session->quotes_left = quote_count;
+  uint64_t random = markov_random_state;
+  markov_random_seed(seed);
+  session->random = markov_random_state;
+  markov_random_state = random;
+  atomic_init(&session->blocked, false);
+}
+
+/**
+ * Copies data into the buffer of a MarkovSession, or returns false if it does
+ * not fit. Data longer than the whole buffer is truncated.
+*/
+bool markov_session_write(MarkovSession *session, const char *data, size_t length) {
+  if (length > SESSION_BUFFER_SIZE) { length = SESSION_BUFFER_SIZE; }
+  if (session->buffer_length + length > SESSION_BUFFER_SIZE) { return false; }
+  memcpy(session->buffer + session->buffer_length, data, length);
+  session->buffer_length += length;
+  return true;
+}
+
+/**
+ * Runs a MarkovSession from where it last yielded for at most budget steps of
+ * one word each. Yields early when the buffer is full or the session is done.
+ * The generator of the calling thread is swapped for the session's own, so a
+ * session samples the same quotes whichever workers run it.
+*/
+MarkovSessionStatus markov_session_resume(MarkovSession *session, MarkovFrozen *frozen,
+                                          const MarkovMask *mask, size_t budget) {
+  MarkovSessionStatus status = MARKOV_SESSION_READY;
+  uint64_t random = markov_random_state;
+  markov_random_state = session->random;
+  while (budget > 0 && status == MARKOV_SESSION_READY) {
+    switch (session->point) {
+      case MARKOV_SESSION_SAMPLE: {
+        uint32_t id = session->length <= MAX_QUOTE_LENGTH
+                        ? markov_frozen_get_next(frozen, session->words, mask)
+                        : MARKOV_NO_WORD;
+        if (id == MARKOV_NO_WORD) {
+          session->point = MARKOV_SESSION_END_QUOTE;
+          break;
+        }
+        memmove(session->words, session->words + 1,
+                (MARKOV_CONTEXT_SIZE - 1) * sizeof(uint32_t));
+        session->words[MARKOV_CONTEXT_SIZE - 1] = id;
+        session->word = markov_frozen_emit_word(frozen, id);
+        session->last_word = check_end_condition(session->word);
+        session->point = MARKOV_SESSION_WRITE;
+        budget--;
+        break;
+      }
+      case MARKOV_SESSION_WRITE: {
+        char separator = session->length > 0 ? ' ' : '\0';
+        size_t length = strlen(session->word);
+        if (session->buffer_length + (separator ? 1 : 0) + length > SESSION_BUFFER_SIZE
+            && session->buffer_length > 0) {
+          status = MARKOV_SESSION_BLOCKED;
+          break;
+        }
+        if (separator) {
+          markov_session_write(session, &separator, 1);
+        }
+        markov_session_write(session, session->word, length);
+        session->length++;
+        session->word_count++;
+        session->point =
+            session->last_word ? MARKOV_SESSION_END_QUOTE : MARKOV_SESSION_SAMPLE;
+        break;
+      }
+      case MARKOV_SESSION_END_QUOTE:
+        if (!markov_session_write(session, "\n", 1)) {
+          status = MARKOV_SESSION_BLOCKED;
+          break;
+        }
+        for (size_t i = 0; i < MARKOV_CONTEXT_SIZE; ++i) {
+          session->words[i] = MARKOV_NO_WORD;
+        }
+        session->length = 0;
+        session->point = MARKOV_SESSION_SAMPLE;
+        if (--session->quotes_left == 0) {
+          status = MARKOV_SESSION_DONE;
+        }
+        break;
+    }
+  }
+  session->random = markov_random_state;
+  markov_random_state = random;
+  return status;
+}
+
+/**
+ * A FIFO of runnable MarkovSessions shared by the workers of a
+ * MarkovSessionPool. Each session is queued at most once, so a ring of one
+ * slot per session never overflows. Closed is set once every session is done.
+*/
+typedef struct MarkovSessionQueue {
+  pthread_mutex_t lock;
+  pthread_cond_t ready;
+  size_t capacity;
+  size_t head;
+  size_t count;
+  MarkovSession **sessions;
+  bool closed;
+} MarkovSessionQueue;
+
+/**
+ * Adds a runnable session to a MarkovSessionQueue and wakes a worker.
+*/
+void markov_session_queue_push(MarkovSessionQueue *queue, MarkovSession *session) {
+  pthread_mutex_lock(&queue->lock);
+  queue->sessions[(queue->head + queue->count++) % queue->capacity] = session;
+  pthread_cond_signal(&queue->ready);
+  pthread_mutex_unlock(&queue->lock);
+}
+
+/**
+ * Removes the oldest runnable session of a MarkovSessionQueue, waiting until
+ * there is one. Returns NULL once the queue is closed.
+*/
+MarkovSession *markov_session_queue_pop(MarkovSessionQueue *queue) {
+  pthread_mutex_lock(&queue->lock);
+  while (queue->count == 0 && !queue->closed) {
+    pthread_cond_wait(&queue->ready, &queue->lock);
+  }
+  MarkovSession *session = NULL;
+  if (queue->count > 0) {
+    session = queue->sessions[queue->head];
+    queue->head = (queue->head + 1) % queue->capacity;
+    queue->count--;
+  }
+  pthread_mutex_unlock(&queue->lock);
+  return session;
+}
+
+/**
+ * Closes a MarkovSessionQueue and wakes every waiting worker.
+*/
+void markov_session_queue_close(MarkovSessionQueue *queue) {
+  pthread_mutex_lock(&queue->lock);
+  queue->closed = true;
+  pthread_cond_broadcast(&queue->ready);
+  pthread_mutex_unlock(&queue->lock);
+}
+
+/**
+ * Many MarkovSessions multiplexed over SESSION_THREAD_COUNT workers. Workers
+ * resume runnable sessions for SESSION_STEP_BUDGET words at a time, and a
+ * network thread plays the clients: every SESSION_DRAIN_MICROSECONDS it
+ * empties the buffers of blocked sessions and makes them runnable again.
+*/
+typedef struct MarkovSessionPool {
+  MarkovFrozen *frozen;
+  const MarkovMask *mask;
+  size_t session_count;
+  MarkovSession *sessions;
+  MarkovSessionQueue queue;
+  _Atomic size_t done_count;
+  double start;
+} MarkovSessionPool;
+
+/**
+ * The body of a worker of a MarkovSessionPool.
+*/
+void *markov_session_worker_run(void *state) {
+  MarkovSessionPool *pool = state;
+  MarkovSession *session;
+  while ((session = markov_session_queue_pop(&pool->queue))) {
+    MarkovSessionStatus status = markov_session_resume(session, pool->frozen,
+                                                       pool->mask, SESSION_STEP_BUDGET);
+    if (status == MARKOV_SESSION_READY) {
+      markov_session_queue_push(&pool->queue, session);
+    } else if (status == MARKOV_SESSION_BLOCKED) {
+      session->stalls++;
+      atomic_store_explicit(&session->blocked, true, memory_order_release);
+    } else {
+      /** The client reads the rest of the stream once it ends */
+      session->delivered += session->buffer_length;
+      session->buffer_length = 0;
+      session->finish = get_time_seconds();
+      if (atomic_fetch_add(&pool->done_count, 1) + 1 == pool->session_count) {
+        markov_session_queue_close(&pool->queue);
+      }
+    }
+  }
+  return NULL;
+}
+
+/**
+ * The body of the network thread of a MarkovSessionPool.
+*/
+void *markov_session_network_run(void *state) {
+  MarkovSessionPool *pool = state;
+  struct timespec wait = { 0, SESSION_DRAIN_MICROSECONDS * 1000L };
+  while (atomic_load(&pool->done_count) < pool->session_count) {
+    nanosleep(&wait, NULL);
+    for (size_t i = 0; i < pool->session_count; ++i) {
+      MarkovSession *session = &pool->sessions[i];
+      if (!atomic_load_explicit(&session->blocked, memory_order_acquire)) { continue; }
+      session->delivered += session->buffer_length;
+      session->buffer_length = 0;
+      atomic_store_explicit(&session->blocked, false, memory_order_relaxed);
+      markov_session_queue_push(&pool->queue, session);
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Streams SESSION_QUOTE_COUNT quotes to each of session_count concurrent
+ * sessions on a MarkovSessionPool, then prints the throughput, the memory
+ * held per session, how often sessions waited on their buffer, and the
+ * percentiles of the time each session took to finish.
+*/
+void markov_frozen_report_sessions(MarkovFrozen *frozen, const MarkovMask *mask,
+                                   size_t session_count) {
+  MarkovSessionPool pool;
+  pool.frozen = frozen;
+  pool.mask = mask;
+  pool.session_count = session_count;
+  pool.sessions = malloc(session_count * sizeof(MarkovSession));
+  pthread_mutex_init(&pool.queue.lock, NULL);
+  pthread_cond_init(&pool.queue.ready, NULL);
+  pool.queue.capacity = session_count;
+  pool.queue.head = 0;
+  pool.queue.count = 0;
+  pool.queue.sessions = malloc(session_count * sizeof(MarkovSession *));
+  pool.queue.closed = false;
+  atomic_init(&pool.done_count, 0);
+  for (size_t i = 0; i < session_count; ++i) {
+    markov_session_init(&pool.sessions[i], SESSION_QUOTE_COUNT, LOAD_SEED + i);
+    pool.queue.sessions[pool.queue.count++] = &pool.sessions[i];
+  }
+
+  pool.start = get_time_seconds();
+  pthread_t network;
+  pthread_t workers[SESSION_THREAD_COUNT];
+  pthread_create(&network, NULL, markov_session_network_run, &pool);
+  for (size_t i = 0; i < SESSION_THREAD_COUNT; ++i) {
+    pthread_create(&workers[i], NULL, markov_session_worker_run, &pool);
+  }
+  for (size_t i = 0; i < SESSION_THREAD_COUNT; ++i) {
+    pthread_join(workers[i], NULL);
+  }
+  pthread_join(network, NULL);
+  double elapsed = get_time_seconds() - pool.start;
+
+  MarkovLatencyHistogram latency = {0};
+  size_t words = 0;
+  size_t bytes = 0;
+  size_t stalls = 0;
+  for (size_t i = 0; i < session_count; ++i) {
+    MarkovSession *session = &pool.sessions[i];
+    words += session->word_count;
+    bytes += session->delivered;
+    stalls += session->stalls;
+    markov_histogram_record(&latency, (uint64_t)((session->finish - pool.start) * 1e9));
+  }
+  printf("%zu sessions on %d threads, %zu bytes each\n", session_count,
+         SESSION_THREAD_COUNT, sizeof(MarkovSession));
+  printf("%zu words (%zu bytes) in %.2f s: %.0f words/s, %zu stalls on full buffers\n",
+         words, bytes, elapsed, words / elapsed, stalls);
+  printf("session time: p50 %.1f ms p99 %.1f ms p100 %.1f ms\n",
+         markov_histogram_percentile(&latency, 50) / 1e6,
+         markov_histogram_percentile(&latency, 99) / 1e6,
+         markov_histogram_percentile(&latency, 100) / 1e6);
+  pthread_cond_destroy(&pool.queue.ready);
+  pthread_mutex_destroy(&pool.queue.lock);
+  free(pool.queue.sessions);
+  free(pool.sessions);
+}
+
+/**
+ * The header of a frozen model image written by markov_frozen_save(). It is
+ * followed by the vocabulary as vocab_bytes of NUL terminated words, then by
+ * the contexts, successors and slots arrays, each starting on an 8 byte
+ * boundary. Images use the byte order of the machine that wrote them.
+*/
+typedef struct MarkovImageHeader {
+  char magic[4];
+  uint32_t context_size;
+  uint64_t vocab_size;
+  uint64_t vocab_bytes;
+  uint64_t context_count;
+  uint64_t successor_count;
+  uint64_t slot_count;
+} MarkovImageHeader;
+
+/**
+ * Rounds an image offset up to the next 8 byte boundary.
+*/
+size_t markov_image_align(size_t offset) {
+  return (offset + 7) & ~(size_t)7;
+}
+
+/**
+ * Writes the padding that moves a file from offset to the next 8 byte
+ * boundary and returns the new offset.
+*/
+size_t markov_image_pad(FILE *file, size_t offset) {
+  static const char zeros[8] = {0};
+  size_t aligned = markov_image_align(offset);
+  fwrite(zeros, 1, aligned - offset, file);
+  return aligned;
+}
+
+/**
+ * Saves a MarkovFrozen model as an image that markov_frozen_map() can map
+ * without parsing. Word classes and the vocabulary cap are not saved. Returns
+ * false if the successors are compressed or the file could not be written.
+*/
+bool markov_frozen_save(MarkovFrozen *frozen, const char *file_name) {
+  if (frozen->pages) {
+    fprintf(stderr, "Unable to save a model with compressed successors.\n");
+    return false;
+  }
+  if (frozen->dead_successors) {
+    markov_frozen_compact(frozen);
+  }
+  FILE *file = fopen(file_name, "wb");
+  if (!file) {
+    perror("Unable to open file.");
+    return false;
+  }
+  MarkovImageHeader header = {{'M', 'K', 'V', 'F'}, MARKOV_CONTEXT_SIZE,
+                              frozen->vocab->size, 0, frozen->context_count,
+                              frozen->successor_count, frozen->slot_count};
+  for (size_t i = 0; i < frozen->vocab->size; ++i) {
+    header.vocab_bytes += strlen(frozen->vocab->words[i]) + 1;
+  }
+  fwrite(&header, sizeof(header), 1, file);
+  size_t offset = sizeof(header);
+  for (size_t i = 0; i < frozen->vocab->size; ++i) {
+    const char *word = frozen->vocab->words[i];
+    offset += fwrite(word, 1, strlen(word) + 1, file);
+  }
+  offset = markov_image_pad(file, offset);
+  offset += fwrite(frozen->contexts, sizeof(MarkovFrozenContext),
+                   frozen->context_count, file)
+            * sizeof(MarkovFrozenContext);
+  offset = markov_image_pad(file, offset);
+  offset += fwrite(frozen->successors, sizeof(MarkovFrozenSuccessor),
+                   frozen->successor_count, file)
+            * sizeof(MarkovFrozenSuccessor);
+  markov_image_pad(file, offset);
+  fwrite(frozen->slots, sizeof(uint32_t), frozen->slot_count, file);
+  bool failed = ferror(file);
+  return fclose(file) == 0 && !failed;
+}
+
+/**
+ * Returns true if a vocabulary holds exactly the size NUL terminated words
+ * stored back to back in words, in the same order.
+*/
+bool markov_vocab_matches(MarkovVocab *vocab, const char *words, size_t size) {
+  if (vocab->size != size) { return false; }
+  for (size_t i = 0; i < size; ++i) {
+    if (strcmp(vocab->words[i], words) != 0) { return false; }
+    words += strlen(words) + 1;
+  }
+  return true;
+}
+
+/**
+ * Returns true if size bytes at image hold a well formed model image: the
+ * sections fit the file exactly, the vocabulary holds vocab_size words,
+ * every word id, successor block and slot is in range, and the index holds
+ * each context once with at least as many empty slots as contexts, so
+ * sampling from the mapped model cannot read outside of it or probe forever.
+*/
+bool markov_image_check(const void *image, size_t size) {
+  const MarkovImageHeader *header = image;
+  if (memcmp(header->magic, "MKVF", 4) != 0
+      || header->context_size != MARKOV_CONTEXT_SIZE
+      || header->vocab_bytes > size || header->context_count > size
+      || header->successor_count > size
+      || header->slot_count == 0 || header->slot_count > size
+      || (header->slot_count & (header->slot_count - 1)) != 0
+      || header->slot_count < header->context_count * 2) {
+    return false;
+  }
+  size_t contexts = markov_image_align(sizeof(MarkovImageHeader) + header->vocab_bytes);
+  size_t successors = markov_image_align(contexts + header->context_count
+                                         * sizeof(MarkovFrozenContext));
+  size_t slots = markov_image_align(successors + header->successor_count
+                                    * sizeof(MarkovFrozenSuccessor));
+  if (slots + header->slot_count * sizeof(uint32_t) != size) { return false; }
+
+  const char *words = (const char *)image + sizeof(MarkovImageHeader);
+  size_t word_count = 0;
+  for (size_t i = 0; i < header->vocab_bytes; ++i) {
+    word_count += words[i] == '\0';
+  }
+  if (word_count != header->vocab_size
+      || (header->vocab_bytes > 0 && words[header->vocab_bytes - 1] != '\0')) {
+    return false;
+  }
+  const MarkovFrozenContext *context =
+      (const MarkovFrozenContext *)((const char *)image + contexts);
+  const MarkovFrozenSuccessor *successor =
+      (const MarkovFrozenSuccessor *)((const char *)image + successors);
+  const uint32_t *slot = (const uint32_t *)((const char *)image + slots);
+  for (size_t i = 0; i < header->context_count; ++i) {
+    if (context[i].length == 0 || context[i].total == 0
+        || context[i].first > header->successor_count
+        || context[i].length > header->successor_count - context[i].first) {
+      return false;
+    }
+    for (size_t j = 0; j < MARKOV_CONTEXT_SIZE; ++j) {
+      if (context[i].words[j] != MARKOV_NO_WORD
+          && context[i].words[j] >= header->vocab_size) { return false; }
+    }
+  }
+  for (size_t i = 0; i < header->successor_count; ++i) {
+    if (successor[i].word >= header->vocab_size) { return false; }
+  }
+  size_t used_slots = 0;
+  for (size_t i = 0; i < header->slot_count; ++i) {
+    if (slot[i] == MARKOV_NO_WORD) { continue; }
+    if (slot[i] >= header->context_count) { return false; }
+    used_slots++;
+  }
+  /** Probes for unknown contexts only stop at an empty slot */
+  return used_slots == header->context_count;
+}
+
+/**
+ * Maps an image written by markov_frozen_save() into a read-only MarkovFrozen
+ * model whose contexts, successors and slots point into the mapping. If one
+ * of the vocab_count vocabularies in vocabs holds the same words, it is used
+ * and shared_vocab is set, so the model does not own it; otherwise the model
+ * interns its own. Returns NULL if the file is not a valid image. The caller
+ * is responsible for freeing the returned model.
+*/
+MarkovFrozen *markov_frozen_map(const char *file_name, MarkovVocab **vocabs,
+                                size_t vocab_count) {
+  int fd = open(file_name, O_RDONLY);
+  if (fd < 0) {
+    perror("Unable to open file.");
+    return NULL;
+  }
+  struct stat info;
+  void *image = MAP_FAILED;
+  if (fstat(fd, &info) == 0 && (size_t)info.st_size >= sizeof(MarkovImageHeader)) {
+    image = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+  close(fd);
+  if (image == MAP_FAILED) {
+    fprintf(stderr, "Unable to map %s.\n", file_name);
+    return NULL;
+  }
+  const MarkovImageHeader *header = image;
+  size_t size = info.st_size;
+  if (!markov_image_check(image, size)) {
+    fprintf(stderr, "%s is not a model image.\n", file_name);
+    munmap(image, size);
+    return NULL;
+  }
+  size_t contexts = markov_image_align(sizeof(MarkovImageHeader) + header->vocab_bytes);
+  size_t successors = markov_image_align(contexts + header->context_count
+                                         * sizeof(MarkovFrozenContext));
+  size_t slots = markov_image_align(successors + header->successor_count
+                                    * sizeof(MarkovFrozenSuccessor));
+
+  MarkovFrozen *frozen = calloc(1, sizeof(MarkovFrozen));
+  frozen->image = image;
+  frozen->image_size = size;
+  const char *words = (const char *)image + sizeof(MarkovImageHeader);
+  for (size_t i = 0; i < vocab_count && !frozen->vocab; ++i) {
+    if (markov_vocab_matches(vocabs[i], words, header->vocab_size)) {
+      frozen->vocab = vocabs[i];
+      frozen->shared_vocab = true;
+    }
+  }
+  if (!frozen->vocab) {
+    frozen->vocab = markov_vocab_new();
+    for (size_t i = 0; i < header->vocab_size; ++i) {
+      markov_vocab_intern(frozen->vocab, words);
+      words += strlen(words) + 1;
+    }
+  }
+  frozen->context_count = header->context_count;
+  frozen->contexts = (MarkovFrozenContext *)((char *)image + contexts);
+  frozen->hits = calloc(frozen->context_count, sizeof(size_t));
+  frozen->successor_count = header->successor_count;
+  frozen->successors = (MarkovFrozenSuccessor *)((char *)image + successors);
+  frozen->slot_count = header->slot_count;
+  frozen->slots = (uint32_t *)((char *)image + slots);
+  return frozen;
+}
+
+/**
+ * A model of a MarkovRegistry. Frozen is NULL while the model is not mapped,
+ * and mask holds the ids of BANNED_WORDS in the mapped model. Loading is set
+ * while a thread maps the model without holding the registry lock. Users
+ * counts the callers holding or loading the model, which is never evicted
+ * while in use; last_used orders the models for eviction.
+*/
+typedef struct MarkovRegistryEntry {
+  char *name;
+  char *file_name;
+  MarkovFrozen *frozen;
+  MarkovMask *mask;
+  bool loading;
+  size_t bytes;
+  size_t users;
+  uint64_t last_used;
+  size_t uses;
+  size_t loads;
+} MarkovRegistryEntry;
+
+/**
+ * A vocabulary shared by the mapped models of a MarkovRegistry built with the
+ * same words, and the number of those models.
+*/
+typedef struct MarkovSharedVocab {
+  MarkovVocab *vocab;
+  size_t users;
+} MarkovSharedVocab;
+
+/**
+ * Maps model names to image files, mapping and prewarming each model on first
+ * use. While the mapped models take more than budget bytes, the least recently
+ * used models that are not in use are unmapped. Models built with the same
+ * vocabulary share one MarkovVocab. All functions are thread safe. Entries are
+ * allocated one by one, so an acquired entry stays valid while more models are
+ * added. Models are mapped and prewarmed outside the lock, and loaded is
+ * signalled when a load finishes.
+*/
+typedef struct MarkovRegistry {
+  pthread_mutex_t lock;
+  pthread_cond_t loaded;
+  size_t budget;
+  size_t resident;
+  uint64_t clock;
+  size_t evictions;
+  size_t entry_count;
+  size_t entry_capacity;
+  MarkovRegistryEntry **entries;
+  size_t vocab_count;
+  MarkovSharedVocab *vocabs;
+} MarkovRegistry;
+
+/**
+ * Returns a new, empty MarkovRegistry with a memory budget in bytes. The
+ * caller is responsible for freeing it with markov_registry_free().
+*/
+MarkovRegistry *markov_registry_new(size_t budget) {
+  MarkovRegistry *registry = calloc(1, sizeof(MarkovRegistry));
+  pthread_mutex_init(&registry->lock, NULL);
+  pthread_cond_init(&registry->loaded, NULL);
+  registry->budget = budget;
+  return registry;
+}
+
+/**
+ * Adds a model name and the image file it is mapped from to a MarkovRegistry.
+*/
+void markov_registry_add(MarkovRegistry *registry, const char *name,
+                         const char *file_name) {
+  pthread_mutex_lock(&registry->lock);
+  if (registry->entry_count == registry->entry_capacity) {
+    registry->entry_capacity =
+        registry->entry_capacity ? registry->entry_capacity * 2 : 16;
+    registry->entries = realloc(registry->entries, registry->entry_capacity
+                                * sizeof(MarkovRegistryEntry *));
+  }
+  MarkovRegistryEntry *entry = calloc(1, sizeof(MarkovRegistryEntry));
+  registry->entries[registry->entry_count++] = entry;
+  entry->name = strdup(name);
+  entry->file_name = strdup(file_name);
+  pthread_mutex_unlock(&registry->lock);
+}
+
+/**
+ * Adds the models listed in a manifest to a MarkovRegistry, one tab separated
+ * name and image file per line. Returns false if the manifest could not be
+ * read.
+*/
+bool markov_registry_load_manifest(MarkovRegistry *registry, const char *file_name) {
+  FILE *file = fopen(file_name, "r");
+  if (!file) {
+    perror("Unable to open file.");
+    return false;
+  }
+  char line[MARKOV_LINE_SIZE];
+  char *save;
+  while (fgets(line, sizeof(line), file)) {
+    char *name = strtok_r(line, "\t\n\r", &save);
+    char *image = strtok_r(NULL, "\t\n\r", &save);
+    if (name && image) {
+      markov_registry_add(registry, name, image);
+    }
+  }
+  fclose(file);
+  return true;
+}
+
+/**
+ * Releases one use of a vocabulary of a MarkovRegistry, freeing it once no
+ * model or load uses it. Must be called with the registry locked.
+*/
+void markov_registry_release_vocab(MarkovRegistry *registry, MarkovVocab *vocab) {
+  for (size_t i = 0; i < registry->vocab_count; ++i) {
+    if (registry->vocabs[i].vocab != vocab) { continue; }
+    if (--registry->vocabs[i].users == 0) {
+      markov_vocab_free(registry->vocabs[i].vocab);
+      registry->vocabs[i] = registry->vocabs[--registry->vocab_count];
+    }
+    return;
+  }
+}
+
+/**
+ * Unmaps the model of a registry entry and releases its share of its
+ * vocabulary. Must be called with the registry locked.
+*/
+void markov_registry_unmap(MarkovRegistry *registry, MarkovRegistryEntry *entry) {
+  markov_registry_release_vocab(registry, entry->frozen->vocab);
+  madvise(entry->frozen->image, entry->frozen->image_size, MADV_DONTNEED);
+  markov_frozen_free(entry->frozen);
+  markov_mask_free(entry->mask);
+  entry->frozen = NULL;
+  entry->mask = NULL;
+  registry->resident -= entry->bytes;
+  entry->bytes = 0;
+}
+
+/**
+ * Unmaps the least recently used models that are not in use until the mapped
+ * models fit the budget of a MarkovRegistry, or none is left to unmap. Must
+ * be called with the registry locked.
+*/
+void markov_registry_evict(MarkovRegistry *registry) {
+  while (registry->resident > registry->budget) {
+    MarkovRegistryEntry *victim = NULL;
+    for (size_t i = 0; i < registry->entry_count; ++i) {
+      MarkovRegistryEntry *entry = registry->entries[i];
+      if (entry->frozen && entry->users == 0
+          && (!victim || entry->last_used < victim->last_used)) {
+        victim = entry;
+      }
+    }
+    if (!victim) { return; }
+    markov_registry_unmap(registry, victim);
+    registry->evictions++;
+  }
+}
+
+/**
+ * Maps, prewarms and masks the model of a registry entry that is marked as
+ * loading, with the registry unlocked so that other models can be acquired
+ * meanwhile. The shared vocabularies the image may borrow are held for the
+ * duration of the load so that no eviction frees them. Must be called with
+ * the registry locked, and returns with it locked.
+*/
+void markov_registry_load(MarkovRegistry *registry, MarkovRegistryEntry *entry) {
+  size_t vocab_count = registry->vocab_count;
+  MarkovVocab **vocabs = malloc((vocab_count + 1) * sizeof(MarkovVocab *));
+  for (size_t i = 0; i < vocab_count; ++i) {
+    vocabs[i] = registry->vocabs[i].vocab;
+    registry->vocabs[i].users++;
+  }
+  pthread_mutex_unlock(&registry->lock);
+  MarkovFrozen *frozen = markov_frozen_map(entry->file_name, vocabs, vocab_count);
+  MarkovMask *mask = NULL;
+  if (frozen) {
+    prewarm_pages(frozen->image, frozen->image_size);
+    mask = markov_frozen_mask_words(frozen, BANNED_WORDS);
+  }
+  pthread_mutex_lock(&registry->lock);
+  /** The registry owns every vocabulary, so models only borrow them */
+  if (frozen && !frozen->shared_vocab) {
+    registry->vocabs = realloc(registry->vocabs, (registry->vocab_count + 1)
+                               * sizeof(MarkovSharedVocab));
+    registry->vocabs[registry->vocab_count].vocab = frozen->vocab;
+    registry->vocabs[registry->vocab_count++].users = 0;
+    frozen->shared_vocab = true;
+  }
+  for (size_t i = 0; frozen && i < registry->vocab_count; ++i) {
+    if (registry->vocabs[i].vocab == frozen->vocab) {
+      registry->vocabs[i].users++;
+    }
+  }
+  for (size_t i = 0; i < vocab_count; ++i) {
+    markov_registry_release_vocab(registry, vocabs[i]);
+  }
+  free(vocabs);
+  if (frozen) {
+    entry->frozen = frozen;
+    entry->mask = mask;
+    entry->bytes = frozen->image_size + frozen->context_count * sizeof(size_t);
+    entry->loads++;
+    registry->resident += entry->bytes;
+  }
+  entry->loading = false;
+  pthread_cond_broadcast(&registry->loaded);
+}
+
+/**
+ * Returns the entry of a model of a MarkovRegistry with its model mapped,
+ * mapping and prewarming it if needed, and marks it in use until
+ * markov_registry_release(). Callers of a model another thread is loading
+ * wait for that load. Returns NULL if the name is unknown or the image could
+ * not be mapped.
+*/
+MarkovRegistryEntry *markov_registry_acquire(MarkovRegistry *registry,
+                                             const char *name) {
+  pthread_mutex_lock(&registry->lock);
+  MarkovRegistryEntry *entry = NULL;
+  for (size_t i = 0; i < registry->entry_count && !entry; ++i) {
+    if (strcmp(registry->entries[i]->name, name) == 0) {
+      entry = registry->entries[i];
+    }
+  }
+  if (!entry) {
+    pthread_mutex_unlock(&registry->lock);
+    return NULL;
+  }
+  entry->users++;
+  while (entry->loading) {
+    pthread_cond_wait(&registry->loaded, &registry->lock);
+  }
+  if (!entry->frozen) {
+    entry->loading = true;
+    markov_registry_load(registry, entry);
+  }
+  if (!entry->frozen) {
+    entry->users--;
+    pthread_mutex_unlock(&registry->lock);
+    return NULL;
+  }
+  entry->uses++;
+  entry->last_used = ++registry->clock;
+  markov_registry_evict(registry);
+  pthread_mutex_unlock(&registry->lock);
+  return entry;
+}
+
+/**
+ * Marks a model acquired with markov_registry_acquire() as no longer in use,
+ * and evicts models if the registry is over its budget.
+*/
+void markov_registry_release(MarkovRegistry *registry, MarkovRegistryEntry *entry) {
+  pthread_mutex_lock(&registry->lock);
+  entry->users--;
+  markov_registry_evict(registry);
+  pthread_mutex_unlock(&registry->lock);
+}
+
+/**
+ * Prints the uses and loads of every model of a MarkovRegistry, the bytes
+ * mapped and the number of evictions to stderr.
+*/
+void markov_registry_report(MarkovRegistry *registry) {
+  pthread_mutex_lock(&registry->lock);
+  for (size_t i = 0; i < registry->entry_count; ++i) {
+    MarkovRegistryEntry *entry = registry->entries[i];
+    fprintf(stderr, "%s: %zu uses, %zu loads, %s\n", entry->name, entry->uses,
+            entry->loads, entry->frozen ? "mapped" : "not mapped");
+  }
+  fprintf(stderr, "%zu of %zu bytes mapped, %zu shared vocabularies, %zu evictions\n",
+          registry->resident, registry->budget, registry->vocab_count,
+          registry->evictions);
+  pthread_mutex_unlock(&registry->lock);
+}
+
+/**
+ * Unmaps every model and frees all the data associated with a
+ * MarkovRegistry.
+*/
+void markov_registry_free(MarkovRegistry *registry) {
+  if (!registry) { return; }
+  for (size_t i = 0; i < registry->entry_count; ++i) {
+    MarkovRegistryEntry *entry = registry->entries[i];
+    if (entry->frozen) {
+      markov_registry_unmap(registry, entry);
+    }
+    free(entry->name);
+    free(entry->file_name);
+    free(entry);
+  }
+  pthread_mutex_destroy(&registry->lock);
+  pthread_cond_destroy(&registry->loaded);
+  free(registry->entries);
+  free(registry->vocabs);
+  free(registry);
+}
+
+/**
+ * Prints the command line usage to stderr.
+*/
+void print_usage(const char *program) {
+  fprintf(stderr,
+          "usage: %s                         print quotes trained on FILE_NAME\n"
+          "       %s train <quotes> <table>  save a quotes file as a table\n"
+          "       %s merge <table>... <out>  add the counts of any number of tables\n"
+          "       %s apply <base> <delta> <out>\n"
+          "                                   add a delta table to a base table\n"
+          "       %s generate <table> [<quotes>...]\n"
+          "                                   print quotes from a table plus updates\n"
+          "       %s analyze <table> [<csr>] analyze the transition graph of a table\n"
+          "       %s drift <old> <new>       compare the successors of two tables\n"
+          "       %s top <quotes> [-w <word>] [-a <author>]\n"
+          "                                   print the top contexts and pairs\n"
+          "       %s metrics [<quotes>]      print diversity metrics of quotes\n"
+          "       %s load <table> open <rate> | closed <clients>\n"
+          "                                   measure throughput and latency\n"
+          "       %s sessions <table> <count> stream quotes to many sessions\n"
+          "       %s compile <table> <image> save a table as a mappable image\n"
+          "       %s registry <manifest> <name>...\n"
+          "                                   print a quote from each named model\n",
+          program, program, program, program, program, program, program, program,
+          program, program, program, program, program);
+}
+
+int main(int argc, char **argv) {
+  const char *table_name = NULL;
+  if (argc == 4 && strcmp(argv[1], "train") == 0) {
+    MarkovModel *model = markov_model_load_file(argv[2], NULL, NULL);
+    bool saved = model && markov_model_save(model, argv[3]);
+    markov_model_free(model);
+    return saved ? EXIT_SUCCESS : EXIT_FAILURE;
+  } else if ((argc >= 4 && strcmp(argv[1], "merge") == 0)
+             || (argc == 5 && strcmp(argv[1], "apply") == 0)) {
+    bool merged = markov_table_merge(argv + 2, argc - 3, argv[argc - 1]);
+    return merged ? EXIT_SUCCESS : EXIT_FAILURE;
+  } else if ((argc == 3 || argc == 4) && strcmp(argv[1], "analyze") == 0) {
+    MarkovFrozen *frozen = markov_frozen_build_table(argv[2], NULL, 0);
+    bool analyzed = frozen
+        && markov_frozen_report_graph(frozen, argc == 4 ? argv[3] : NULL);
+    markov_frozen_free(frozen);
+    return analyzed ? EXIT_SUCCESS : EXIT_FAILURE;
+  } else if (argc == 4 && strcmp(argv[1], "drift") == 0) {
+    bool compared = markov_table_report_drift(argv[2], argv[3], ANALYSIS_THREAD_COUNT);
+    return compared ? EXIT_SUCCESS : EXIT_FAILURE;
+  } else if (argc >= 3 && argc % 2 == 1 && strcmp(argv[1], "top") == 0) {
+    const char *word = NULL;
+    const char *author = NULL;
+    for (int i = 3; i < argc; i += 2) {
+      if (strcmp(argv[i], "-w") == 0) {
+        word = argv[i + 1];
+      } else if (strcmp(argv[i], "-a") == 0) {
+        author = argv[i + 1];
+      } else {
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+      }
+    }
+    bool reported = markov_report_top_ngrams(argv[2], word, author);
+    return reported ? EXIT_SUCCESS : EXIT_FAILURE;
+  } else if ((argc == 2 || argc == 3) && strcmp(argv[1], "metrics") == 0) {
+    bool reported = markov_report_metrics(argc == 3 ? argv[2] : NULL);
+    return reported ? EXIT_SUCCESS : EXIT_FAILURE;
+  } else if (argc == 5 && strcmp(argv[1], "load") == 0) {
+    bool open_loop = strcmp(argv[3], "open") == 0;
+    double rate = atof(argv[4]);
+    if ((!open_loop && strcmp(argv[3], "closed") != 0) || rate < 1) {
+      print_usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+    MarkovFrozen *frozen = markov_frozen_build_table(argv[2], NULL, 0);
+    if (!frozen) { return EXIT_FAILURE; }
+    MarkovMask *mask = markov_frozen_mask_words(frozen, BANNED_WORDS);
+    markov_frozen_report_load(frozen, mask, open_loop, rate);
+    markov_mask_free(mask);
+    markov_frozen_free(frozen);
+    return EXIT_SUCCESS;
+  } else if (argc == 4 && strcmp(argv[1], "sessions") == 0) {
+    long count = atol(argv[3]);
+    if (count < 1) {
+      print_usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+    MarkovFrozen *frozen = markov_frozen_build_table(argv[2], NULL, 0);
+    if (!frozen) { return EXIT_FAILURE; }
+    MarkovMask *mask = markov_frozen_mask_words(frozen, BANNED_WORDS);
+    markov_frozen_report_sessions(frozen, mask, count);
+    markov_mask_free(mask);
+    markov_frozen_free(frozen);
+    return EXIT_SUCCESS;
+  } else if (argc == 4 && strcmp(argv[1], "compile") == 0) {
+    MarkovFrozen *frozen = markov_frozen_build_table(argv[2], NULL, 0);
+    bool saved = frozen && markov_frozen_save(frozen, argv[3]);
+    markov_frozen_free(frozen);
+    return saved ? EXIT_SUCCESS : EXIT_FAILURE;
+  } else if (argc >= 4 && strcmp(argv[1], "registry") == 0) {
+    MarkovRegistry *registry = markov_registry_new(REGISTRY_MEMORY_BUDGET);
+    bool served = markov_registry_load_manifest(registry, argv[2]);
+    for (int i = 3; i < argc && served; ++i) {
+      MarkovRegistryEntry *entry = markov_registry_acquire(registry, argv[i]);
+      if (!entry) {
+        fprintf(stderr, "Unable to load model %s.\n", argv[i]);
+        served = false;
+        break;
+      }
+      char *quote = markov_frozen_generate_quote(entry->frozen, entry->mask);
+      printf("%s: %s\n", argv[i], quote);
+      free(quote);
+      markov_registry_release(registry, entry);
+    }
+    if (BENCHMARK_QUOTE_COUNT) {
+      markov_registry_report(registry);
+    }
+    markov_registry_free(registry);
+    return served ? EXIT_SUCCESS : EXIT_FAILURE;
+  } else if (argc >= 3 && strcmp(argv[1], "generate") == 0) {
+    table_name = argv[2];
+  } else if (argc != 1) {
+    print_usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  if (SUFFIX_ENGINE && !table_name) {
+    bool written = markov_suffix_write_quotes(FILE_NAME, QUOTE_COUNT);
+    return written ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+
+  MarkovLive *live = NULL;
+  MarkovFrozen *frozen = NULL;
+  if (table_name) {
+    frozen = markov_frozen_build_table(table_name, argv + 3, argc - 3);
+    if (!frozen) { return EXIT_FAILURE; }
+  } else if (PREVIEW_QUOTE_COUNT) {
+    live = markov_live_start(FILE_NAME, PREVIEW_QUOTE_COUNT);
+    if (!live) { return EXIT_FAILURE; }
+  } else {
+    frozen = markov_frozen_build_file(FILE_NAME);
+    if (!frozen) { return EXIT_FAILURE; }
+  }
+
+  /** Quotes reference the words of the model they came from, so the writer is
+   * flushed before a newer model can be swapped in and the old one freed */
+  MarkovQuoteWriter *writer = calloc(1, sizeof(MarkovQuoteWriter));
+  writer->fd = STDOUT_FILENO;
+  MarkovQuote quote;
+  MarkovFrozen *model = live ? live->current : frozen;
+  MarkovMask *mask = markov_frozen_mask_words(model, BANNED_WORDS);
+  if (BENCHMARK_QUOTE_COUNT && BANNED_WORDS[0]) {
+    markov_frozen_report_mask(model, mask, BENCHMARK_QUOTE_COUNT);
+  }
+  bool written = true;
+  for (size_t i = 0; i < QUOTE_COUNT && written; ++i) {
+    if (live && atomic_load(&live->pending)) {
+      written = markov_quote_writer_flush(writer);
+      model = markov_live_get(live);
+      markov_mask_free(mask);
+      mask = markov_frozen_mask_words(model, BANNED_WORDS);
+    }
+    if (STREAM_QUOTES) {
+      written = written && markov_quote_writer_stream(writer, model, mask);
+      continue;
+    }
+    markov_frozen_generate_words(model, mask, &quote);
+    written = written && markov_quote_writer_add(writer, &quote);
+  }
+  written = written && markov_quote_writer_flush(writer);
+  free(writer);
+  markov_mask_free(mask);
+
+  markov_live_free(live);
+  markov_frozen_free(frozen);
+  return written ? EXIT_SUCCESS : EXIT_FAILURE;
 }